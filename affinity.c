@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * CPU affinity helpers for NUMA machines.
+ * Together with first-touch allocation (every page of a band is first written by the thread that owns the band) pinning
+ * keeps the pages of a band on the NUMA node of the core that works on it.
+ * The including program must define _GNU_SOURCE before its first #include.
+ */
+
+/**
+ * List the CPUs this process may run on, grouped by NUMA node (node 0 first), so that consecutive bands end up on the
+ * same node. Without NUMA information in /sys the CPUs are listed in order.
+ * @param cpus filled with the CPU numbers
+ * @param max size of cpus
+ * @return the number of CPUs listed
+ */
+int numaOrderedCpus(int *cpus, int max)
+{
+    cpu_set_t allowed, listed;
+    int count = 0, node, cpu;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return 0;
+    }
+    CPU_ZERO(&listed);
+    for (node = 0; node < 1024 && count < max; ++node)
+    {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (!file)
+        {
+            // node numbers may have holes, give up after a few missing ones
+            if (node > 64)
+            {
+                break;
+            }
+            continue;
+        }
+        if (fgets(list, sizeof(list), file))
+        {
+            // format "0-3,8-11"
+            char *range = strtok(list, ",\n");
+            while (range && count < max)
+            {
+                int first, last;
+                if (sscanf(range, "%d-%d", &first, &last) != 2)
+                {
+                    last = first = atoi(range);
+                }
+                for (cpu = first; cpu <= last && count < max; ++cpu)
+                {
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &listed))
+                    {
+                        CPU_SET(cpu, &listed);
+                        cpus[count++] = cpu;
+                    }
+                }
+                range = strtok(NULL, ",\n");
+            }
+        }
+        fclose(file);
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE && count < max; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &listed))
+        {
+            cpus[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+/**
+ * Pin the calling thread to a single CPU.
+ * @param cpu
+ * @return 0 on success
+ */
+int pinThread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/**
+ * CPU for the thread of the given band: the bands are spread evenly over the NUMA ordered CPU list, so that
+ * neighbouring bands share a node.
+ * @param band
+ * @param bands
+ * @param cpus as returned by numaOrderedCpus
+ * @param cpuCount
+ * @return
+ */
+int bandCpu(int band, int bands, const int *cpus, int cpuCount)
+{
+    if (bands <= cpuCount)
+    {
+        return cpus[(int)((long long)band * cpuCount / bands)];
+    }
+    return cpus[band % cpuCount];
+}
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+
+#define ARENA_BLOCK_SIZE (2UL << 20)
+#define ARENA_ALIGNMENT 64
+
+/**
+ * Region allocator for the image buffers: every allocation is carved out of a few big blocks (obtained with
+ * hugeAlloc(), so --huge-pages applies to them), and everything is released with a single arenaRelease().
+ * Needs hugepage.c.
+ */
+typedef struct arenaBlock
+{
+    struct arenaBlock *next;
+    size_t size;
+    size_t used;
+} arenaBlock;
+
+typedef struct arena
+{
+    arenaBlock *blocks;
+} arena;
+
+/**
+ * Allocate size bytes, aligned to a cache line, from the arena.
+ * Big requests get a block of their own; as the blocks are mapped lazily, the pages of a buffer that are never written
+ * (e.g. the unused end of an upper bound sized buffer) do not take any memory.
+ * @param memory
+ * @param size
+ * @return the buffer, or NULL
+ */
+void *arenaAlloc(arena *memory, size_t size)
+{
+    size_t header = (sizeof(arenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    arenaBlock *block = memory->blocks;
+    if (!block || block->size - block->used < size)
+    {
+        size_t blockSize = header + size > ARENA_BLOCK_SIZE ? header + size : ARENA_BLOCK_SIZE;
+        block = (arenaBlock *)hugeAlloc(blockSize);
+        if (!block)
+        {
+            return NULL;
+        }
+        block->size = blockSize;
+        block->used = header;
+        if (memory->blocks && memory->blocks->size - memory->blocks->used > blockSize - header - size)
+        {
+            // keep allocating from the current block, it has more room left than the new one
+            block->next = memory->blocks->next;
+            memory->blocks->next = block;
+        }
+        else
+        {
+            block->next = memory->blocks;
+            memory->blocks = block;
+        }
+    }
+    void *buffer = (char *)block + block->used;
+    block->used += size;
+    return buffer;
+}
+
+/**
+ * Release every buffer allocated from the arena.
+ * @param memory
+ */
+void arenaRelease(arena *memory)
+{
+    while (memory->blocks)
+    {
+        arenaBlock *next = memory->blocks->next;
+        hugeFree(memory->blocks, memory->blocks->size);
+        memory->blocks = next;
+    }
+}
+
+/**
+ * Row pointers into a contiguous, row-strided buffer, so that the usual lattice[row][column] indexing works.
+ * @param memory
+ * @param data
+ * @param rows
+ * @param columns
+ * @return the row pointers, allocated from the arena
+ */
+char **rowPointers(arena *memory, char *data, int rows, int columns)
+{
+    char **pointers = (char **)arenaAlloc(memory, rows * sizeof(char *));
+    int row;
+    if (!pointers)
+    {
+        return NULL;
+    }
+    for (row = 0; row < rows; ++row)
+    {
+        pointers[row] = data + (size_t)row * columns;
+    }
+    return pointers;
+}
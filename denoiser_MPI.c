@@ -1,15 +1,49 @@
+#define _GNU_SOURCE
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 //#include <papi.h>
-#include "queue.c"
+#include "options.c"
+#include "stencil.c"
+#include "rng.c"
+#include "fixedpoint.c"
+#include "affinity.c"
+#include "sweep.c"
+#include "hugepage.c"
+#include "arena.c"
+#include "stream.c"
+#include "image_io.c"
+#include "rle.c"
+#include "png_io.c"
 
 #define TOTAL_ITERATIONS 5000000
 #define MASTER_RANK 0
 #define DIRECTIONS 8
+/* number of result pieces the master receives at the same time */
+#define GATHER_WINDOW 16
+/* with --rebalance every tile keeps at least 1/REBALANCE_FLOOR of its share of a sweep, converged or not */
+#define REBALANCE_FLOOR 8
+/* longest path of an image of the job farm, terminating zero included */
+#define FARM_PATH_MAX 4096
+
+/* the neighbourhood selected with --neighborhood, the query protocol only supports radius 1 stencils (the job farm
+ * supports all of them) */
+const stencil *neighbourhood;
+
+/* pixels drawn at a time with --batch, a question (and its answer) carries up to batchSize positions */
+int batchSize = 1;
+/* a question or an answer: up to batchSize positions or sums, the epoch of the sender and the number of positions;
+ * the length is fixed so that every message can be sent with a persistent request */
+#define MESSAGE_LENGTH (batchSize + 2)
+#define EPOCH_INDEX batchSize
+#define COUNT_INDEX (batchSize + 1)
 
 /**
  * generates a random number between 0 and 1.0 (both inclusive)
@@ -35,9 +69,13 @@ enum MessageType
     TOP_LEFT = 7,
     ROWS = 20,
     COLUMNS = 21,
+    TILE_OFFSET = 22,
     QUESTION = 500,
     ANSWER = 600,
-    FINISHED = 700,
+    HALO = 700,
+    STOP_PROGRESS = 800,
+    JOB_REQUEST = 900,
+    JOB = 901,
     IMAGE_START = 1000,
     FINAL_IMAGE_START = 60000
 };
@@ -69,43 +107,73 @@ void receiveMessage(void *data, int count, MPI_Datatype datatype, int source, in
 }
 
 /**
- * initializes an answer request for the future for the given neighbour and current process.
- * @param neighbour
- * @param position
- * @param answerRequest
+ * Everything needed to answer the neighbours' questions, from the compute loop or from the progress thread.
+ * The compute loop only writes the lattice, and only the outermost rows and columns are read by the answers, so
+ * with a progress thread the compute loop takes borderLock just to flip a pixel on the border of its portion.
+ *
+ * Every question and answer carries the epoch of its sender for the receiver's side: the number of flips of the
+ * sender's border pixels that the receiver's questions can see. An answer whose epoch is older than the latest one
+ * heard from that neighbour may be stale (see --prefetch).
+ * The same neighbour and tag pairs are used over and over, so all requests are persistent: they are created once and
+ * restarted with MPI_Start.
  */
-void initializeAnAnswer(int neighbour, int *position, MPI_Request *answerRequest)
+typedef struct answerInfo
 {
-    MPI_Irecv((void *)position, 1, MPI_INT, neighbour, QUESTION, MPI_COMM_WORLD, answerRequest);
-}
+    char **subImage;
+    int rows;
+    int columns;
+    int *neighbours;
+    int *positions; /* MESSAGE_LENGTH per direction, the asked positions */
+    int *sums;      /* MESSAGE_LENGTH per direction, the answers (kept until the answer response is finished) */
+    MPI_Request answerRequests[DIRECTIONS + 1]; /* persistent, the last one is the stop request of the progress thread */
+    MPI_Request answerResponses[DIRECTIONS];    /* persistent */
+    unsigned borderEpochs[DIRECTIONS];      /* own border flips visible to the neighbour of every direction */
+    atomic_uint questionEpochs[DIRECTIONS]; /* latest epoch piggybacked on the questions of every neighbour */
+    int progressThread;
+    pthread_mutex_t borderLock;
+    /* with --shared-memory the neighbours on the same node are not asked: their portions are read directly */
+    MPI_Win window;
+    int sharedNeighbours[DIRECTIONS];   /* rank of every neighbour on the node, -1 otherwise */
+    char **sharedPortions[DIRECTIONS];  /* rows of their portions */
+} answerInfo;
 
 /**
- * initializes an answer request for the future for all neighbours and current process.
+ * initializes the answer requests and responses for all neighbours and current process, and starts the answer
+ * requests.
  * an answer request is finished -- received when a neighbour asks the current process a question.
  * that means the current process should reply with an answer response to that neighbour.
- * @param neighbours
- * @param positions
- * @param answerRequests
- * @param answerResponses
+ * @param info
  */
-void initializeAnswers(int *neighbours, int *positions, MPI_Request *answerRequests, MPI_Request *answerResponses)
+void initializeAnswers(answerInfo *info)
 {
     int direction;
+    for (direction = 0; direction <= DIRECTIONS; ++direction)
+    {
+        info->answerRequests[direction] = MPI_REQUEST_NULL;
+    }
     for (direction = 0; direction < DIRECTIONS; ++direction)
     {
-        if (neighbours[direction] == -1)
+        info->answerResponses[direction] = MPI_REQUEST_NULL;
+        info->borderEpochs[direction] = 0;
+        atomic_init(info->questionEpochs + direction, 0);
+        if (info->neighbours[direction] == -1)
         {
             // no neighbour in this direction
             continue;
         }
-        initializeAnAnswer(neighbours[direction], positions + direction, answerRequests + direction);
-        answerResponses[direction] = NULL;
+        MPI_Recv_init((void *)(info->positions + direction * MESSAGE_LENGTH), MESSAGE_LENGTH, MPI_INT,
+                      info->neighbours[direction], QUESTION, MPI_COMM_WORLD, info->answerRequests + direction);
+        MPI_Send_init((void *)(info->sums + direction * MESSAGE_LENGTH), MESSAGE_LENGTH, MPI_INT,
+                      info->neighbours[direction], ANSWER, MPI_COMM_WORLD, info->answerResponses + direction);
+        MPI_Start(info->answerRequests + direction);
     }
 }
 
 /**
- * Sum the surroundings of a point in a grid. (Ignores out of boundaries by not considering them in the sum)
- * Also does not include the center point in the sum.
+ * Sum the surroundings of a point in a grid with the selected neighbourhood stencil.
+ * (Ignores out of boundaries by not considering them in the sum)
+ * Also does not include the center point in the sum, which may lie just outside of the grid when answering a
+ * neighbour's question.
  * @param subImage
  * @param rows
  * @param columns
@@ -115,235 +183,801 @@ void initializeAnswers(int *neighbours, int *positions, MPI_Request *answerReque
  */
 int summer(char **subImage, int rows, int columns, int rowCenter, int columnCenter)
 {
-    int sum = 0;
-    int i, j;
-    for (i = rowCenter - 1; i <= rowCenter + 1; ++i)
-    {
-        if (i >= 0 && i < rows)
-        { // if within row boundaries
-            for (j = columnCenter - 1; j <= columnCenter + 1; ++j)
-            {
-                if (j >= 0 && j < columns)
-                { // if within column boundaries
-                    if (i != rowCenter || j != columnCenter)
-                    { // skip center
-                        sum += (int)subImage[i][j];
-                    }
-                }
-            }
-        }
-    }
-    return sum;
+    return neighbourhood->sum(subImage, rows, columns, rowCenter, columnCenter);
 };
 
 /**
- * Test all previously initialized answer requests from neighbours to current process.
- * If any of them is finished (that neighbour asked something for the current process)
- * then, calculate the relevant answer and create an answer response to send it to that neighbour,
- * then, reinitialize that answer request for future questions.
+ * Sum of the portion around a center just outside of it, as asked by the neighbour in the given direction: the
+ * position is the column of the center for TOP and BOTTOM, its row for LEFT and RIGHT, and unused for the corners.
  * @param subImage
  * @param rows
  * @param columns
- * @param neighbours
- * @param positions
- * @param answerRequests
- * @param answerResponses
+ * @param direction
+ * @param position
+ * @return
+ */
+int portionSum(char **subImage, int rows, int columns, int direction, int position)
+{
+    int rowCenter = 0, columnCenter = 0;
+    switch (direction)
+    {
+    case TOP:
+    case TOP_LEFT:
+    case TOP_RIGHT:
+        rowCenter = -1;
+        break;
+    case BOTTOM:
+    case BOTTOM_LEFT:
+    case BOTTOM_RIGHT:
+        rowCenter = rows;
+        break;
+    case LEFT:
+    case RIGHT:
+        rowCenter = position;
+        break;
+    }
+    switch (direction)
+    {
+    case LEFT:
+    case TOP_LEFT:
+    case BOTTOM_LEFT:
+        columnCenter = -1;
+        break;
+    case RIGHT:
+    case TOP_RIGHT:
+    case BOTTOM_RIGHT:
+        columnCenter = columns;
+        break;
+    case TOP:
+    case BOTTOM:
+        columnCenter = position;
+        break;
+    }
+    return summer(subImage, rows, columns, rowCenter, columnCenter);
+}
+
+/**
+ * Answer the question that arrived from the neighbour in the given direction: calculate the sum of the current
+ * process'es portion around every asked center and send them back in a single answer response,
+ * then, restart that answer request for future questions.
+ * @param info
+ * @param direction
+ */
+void answerQuestion(answerInfo *info, int direction)
+{
+    int *positions = info->positions + direction * MESSAGE_LENGTH;
+    int *sums = info->sums + direction * MESSAGE_LENGTH;
+    int i, count = positions[COUNT_INDEX];
+    // the previous answer must be sent before its buffer is reused (an inactive request finishes at once)
+    MPI_Wait(info->answerResponses + direction, MPI_STATUS_IGNORE);
+    atomic_store(info->questionEpochs + direction, (unsigned)positions[EPOCH_INDEX]);
+    for (i = 0; i < count; ++i)
+    {
+        sums[i] = portionSum(info->subImage, info->rows, info->columns, direction, positions[i]);
+    }
+    sums[EPOCH_INDEX] = (int)info->borderEpochs[direction];
+    sums[COUNT_INDEX] = count;
+    MPI_Start(info->answerRequests + direction);
+    MPI_Start(info->answerResponses + direction);
+}
+
+/**
+ * Test all previously initialized answer requests from neighbours to current process.
+ * If any of them is finished (that neighbour asked something for the current process) answer it.
+ * @param info
  */
-void answerAll(char **subImage, int rows, int columns, int *neighbours, int *positions,
-               MPI_Request *answerRequests, MPI_Request *answerResponses)
+void answerAll(answerInfo *info)
 {
-    int position, direction, rowCenter, columnCenter;
+    int direction;
     int flag;
     for (direction = 0; direction < DIRECTIONS; ++direction)
     {
-        if (neighbours[direction] == -1)
+        if (info->neighbours[direction] == -1)
         {
             // no neighbour in this direction
             continue;
         }
-        MPI_Test(answerRequests + direction, &flag, MPI_STATUS_IGNORE);
+        MPI_Test(info->answerRequests + direction, &flag, MPI_STATUS_IGNORE);
         if (flag)
         {
-            position = positions[direction];
-            initializeAnAnswer(neighbours[direction], positions + direction, answerRequests + direction);
-            if (answerResponses[direction])
-            {
-                MPI_Wait(answerResponses + direction, MPI_STATUS_IGNORE);
-                answerResponses[direction] = NULL;
-            }
-            switch (direction)
-            {
-            case TOP:
-            case TOP_LEFT:
-            case TOP_RIGHT:
-                rowCenter = -1;
-                break;
-            case BOTTOM:
-            case BOTTOM_LEFT:
-            case BOTTOM_RIGHT:
-                rowCenter = rows;
-                break;
-            case LEFT:
-            case RIGHT:
-                rowCenter = position;
-                break;
-            }
-            switch (direction)
-            {
-            case LEFT:
-            case TOP_LEFT:
-            case BOTTOM_LEFT:
-                columnCenter = -1;
-                break;
-            case RIGHT:
-            case TOP_RIGHT:
-            case BOTTOM_RIGHT:
-                columnCenter = columns;
-                break;
-            case TOP:
-            case BOTTOM:
-                columnCenter = position;
-                break;
-            }
-            int sum = summer(subImage, rows, columns, rowCenter, columnCenter);
-            MPI_Isend((void *)&sum, 1, MPI_INT, neighbours[direction], ANSWER,
-                      MPI_COMM_WORLD, answerResponses + direction);
+            answerQuestion(info, direction);
         }
     }
 }
 
 /**
- * Notify neighbours that the current process finished all of its iterations and it will terminate
- * when all of its neighbours also finish their iterations.
- * Also receive such information from its neighbours.
- * @param neighbours
- * @param finishedRequests
- * @param finishedResponses
- * @param finishedReqResCount
+ * Once every slave has finished its iterations nobody will ask anything anymore: cancel the answer requests still
+ * waiting for questions (they are always restarted right after a question), wait until the last answer responses
+ * are sent and free the persistent requests.
+ * @param info
  */
-void sendFinishedAll(int *neighbours, MPI_Request *finishedRequests, MPI_Request *finishedResponses, int *finishedReqResCount)
+void stopAnswering(answerInfo *info)
 {
     int direction;
     for (direction = 0; direction < DIRECTIONS; ++direction)
     {
-        if (neighbours[direction] != -1)
+        if (info->answerRequests[direction] != MPI_REQUEST_NULL)
+        {
+            MPI_Cancel(info->answerRequests + direction);
+            MPI_Wait(info->answerRequests + direction, MPI_STATUS_IGNORE);
+            MPI_Request_free(info->answerRequests + direction);
+        }
+        if (info->answerResponses[direction] != MPI_REQUEST_NULL)
+        {
+            MPI_Wait(info->answerResponses + direction, MPI_STATUS_IGNORE);
+            MPI_Request_free(info->answerResponses + direction);
+        }
+    }
+}
+
+/**
+ * Progress thread: block until a neighbour asks something (or the compute thread sends STOP_PROGRESS to its own
+ * rank) and answer immediately, so that the neighbours never wait for the compute loop to poll.
+ * @param argument answerInfo
+ * @return
+ */
+void *progressWorker(void *argument)
+{
+    answerInfo *info = (answerInfo *)argument;
+    int direction;
+    while (1)
+    {
+        MPI_Waitany(DIRECTIONS + 1, info->answerRequests, &direction, MPI_STATUS_IGNORE);
+        if (direction == DIRECTIONS || direction == MPI_UNDEFINED)
         {
-            MPI_Isend(NULL, 0, MPI_INT, neighbours[direction], FINISHED, MPI_COMM_WORLD, finishedRequests + (*finishedReqResCount));
-            MPI_Irecv(NULL, 0, MPI_INT, neighbours[direction], FINISHED, MPI_COMM_WORLD, finishedResponses + (*finishedReqResCount));
-            ++(*finishedReqResCount);
+            break;
         }
+        pthread_mutex_lock(&info->borderLock);
+        answerQuestion(info, direction);
+        pthread_mutex_unlock(&info->borderLock);
     }
-};
+    stopAnswering(info);
+    return NULL;
+}
 
 /**
- * Check if all of the current process'es neighbours has finished their iterations.
- *
- * Use that function so that
- * "If so, terminate the current process, otherwise keep waiting and answering neighbours"
+ * List the questions a pixel needs from the neighbours: the directions (with a neighbour) its surroundings reach
+ * into, and the position to ask in every direction.
+ * @param rowPosition
+ * @param columnPosition
+ * @param rows
+ * @param columns
  * @param neighbours
- * @param finishedRequests
- * @param finishedResponses
- * @param finishedReqResCount
+ * @param directions receives up to DIRECTIONS directions
+ * @param positions receives the position asked in each direction
+ * @return the number of questions
+ */
+int boundaryQuestions(int rowPosition, int columnPosition, int rows, int columns, int *neighbours,
+                      int *directions, int *positions)
+{
+    int count = 0;
+#define QUESTION_FOR(direction, position)  \
+    if (neighbours[direction] != -1)       \
+    {                                      \
+        directions[count] = direction;     \
+        positions[count++] = position;     \
+    }
+    if (rowPosition == 0)
+    {
+        QUESTION_FOR(TOP, columnPosition)
+        if (columnPosition == 0)
+        {
+            QUESTION_FOR(TOP_LEFT, 0)
+        }
+        if (columnPosition == columns - 1)
+        {
+            QUESTION_FOR(TOP_RIGHT, 0)
+        }
+    }
+    if (rowPosition == rows - 1)
+    {
+        QUESTION_FOR(BOTTOM, columnPosition)
+        if (columnPosition == 0)
+        {
+            QUESTION_FOR(BOTTOM_LEFT, 0)
+        }
+        if (columnPosition == columns - 1)
+        {
+            QUESTION_FOR(BOTTOM_RIGHT, 0)
+        }
+    }
+    if (columnPosition == 0)
+    {
+        QUESTION_FOR(LEFT, rowPosition)
+    }
+    if (columnPosition == columns - 1)
+    {
+        QUESTION_FOR(RIGHT, rowPosition)
+    }
+#undef QUESTION_FOR
+    return count;
+}
+
+/**
+ * The direction in which the current process is seen by its neighbour in the given direction.
+ * @param direction
  * @return
  */
-int testFinishedAll(int *neighbours, MPI_Request *finishedRequests, MPI_Request *finishedResponses, int *finishedReqResCount)
+int oppositeDirection(int direction)
 {
-    int requestResult = 1, responseResult = 1;
-    if (*finishedReqResCount > 0)
+    // TOP 0 <-> BOTTOM 2, RIGHT 1 <-> LEFT 3, TOP_RIGHT 4 <-> BOTTOM_LEFT 6, BOTTOM_RIGHT 5 <-> TOP_LEFT 7
+    return (direction & 4) | ((direction + 2) & 3);
+}
+
+/**
+ * Put the portion of the slave in a shared memory window of the slaves of its node, so that the neighbours on the
+ * same node can read its borders directly.
+ * @param slaves
+ * @param rows
+ * @param columns
+ * @param node set to the communicator of the slaves on the node
+ * @param window set to the window
+ * @return the portion, rows * columns pixels
+ */
+char *allocateSharedPortion(MPI_Comm slaves, int rows, int columns, MPI_Comm *node, MPI_Win *window)
+{
+    MPI_Info hints;
+    char *portion;
+    MPI_Comm_split_type(slaves, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, node);
+    MPI_Info_create(&hints);
+    // every portion on its own pages, first touched by its owner
+    MPI_Info_set(hints, "alloc_shared_noncontig", "true");
+    MPI_Win_allocate_shared((MPI_Aint)rows * columns, 1, hints, *node, &portion, window);
+    MPI_Info_free(&hints);
+    // passive target epoch for the whole run, MPI_Win_sync orders the reads and writes of the shared portions
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, *window);
+    return portion;
+}
+
+/**
+ * Find the neighbours on the same node and map their portions; they are then removed from neighbours, so that
+ * they are never asked (nor answered) with messages.
+ * All tiles have the same size.
+ * @param info
+ * @param node
+ * @param memory
+ */
+void shareNeighbours(answerInfo *info, MPI_Comm node, arena *memory)
+{
+    MPI_Group worldGroup, nodeGroup;
+    int direction;
+    MPI_Comm_group(MPI_COMM_WORLD, &worldGroup);
+    MPI_Comm_group(node, &nodeGroup);
+    for (direction = 0; direction < DIRECTIONS; ++direction)
     {
-        MPI_Testall(*finishedReqResCount, finishedRequests, &requestResult, MPI_STATUSES_IGNORE);
-        MPI_Testall(*finishedReqResCount, finishedResponses, &responseResult, MPI_STATUSES_IGNORE);
+        int nodeRank = MPI_UNDEFINED;
+        info->sharedNeighbours[direction] = -1;
+        info->sharedPortions[direction] = NULL;
+        if (info->neighbours[direction] == -1)
+        {
+            continue;
+        }
+        MPI_Group_translate_ranks(worldGroup, 1, info->neighbours + direction, nodeGroup, &nodeRank);
+        if (nodeRank == MPI_UNDEFINED)
+        {
+            // on another node, keep asking
+            continue;
+        }
+        MPI_Aint size;
+        int unit;
+        char *portion;
+        MPI_Win_shared_query(info->window, nodeRank, &size, &unit, &portion);
+        info->sharedPortions[direction] = rowPointers(memory, portion, info->rows, info->columns);
+        info->sharedNeighbours[direction] = info->neighbours[direction];
+        info->neighbours[direction] = -1;
     }
-    return requestResult && responseResult;
-};
+    MPI_Group_free(&worldGroup);
+    MPI_Group_free(&nodeGroup);
+}
 
 /**
- * Ask a question to a neighbour in the given position to calculate the sum for its portion of that position's center.
- * This will create an ask request (MPI_Isend) to notify the neighbour and
- * an ask response (MPI_Irecv) to get the result from the neighbour
- * which will be available when the neighbour answers.
- * @param neighbour
- * @param position
- * @param askRequests
- * @param askReqResCount
- * @param askResponses
- * @param askResponseValues
+ * A block of random pixels and the questions they need from the neighbours, one question per neighbour.
+ * The ask requests (question sends) and ask responses (answer receives) are persistent, one pair per neighbour.
+ */
+typedef struct questionBlock
+{
+    int size;
+    int *rows;      /* batchSize pixels */
+    int *columns;
+    int *questions; /* MESSAGE_LENGTH per direction */
+    int *answers;   /* MESSAGE_LENGTH per direction */
+    int counts[DIRECTIONS];
+    MPI_Request askRequests[DIRECTIONS];
+    MPI_Request askResponses[DIRECTIONS];
+    int answered;
+} questionBlock;
+
+/**
+ * Create the persistent ask requests & responses of a block for all neighbours.
+ * @param block
+ * @param neighbours
+ */
+void initializeQuestions(questionBlock *block, int *neighbours)
+{
+    int direction;
+    block->answered = 1;
+    memset(block->counts, 0, sizeof(block->counts));
+    for (direction = 0; direction < DIRECTIONS; ++direction)
+    {
+        block->askRequests[direction] = MPI_REQUEST_NULL;
+        block->askResponses[direction] = MPI_REQUEST_NULL;
+        if (neighbours[direction] == -1)
+        {
+            // no neighbour in this direction
+            continue;
+        }
+        MPI_Send_init((void *)(block->questions + direction * MESSAGE_LENGTH), MESSAGE_LENGTH, MPI_INT,
+                      neighbours[direction], QUESTION, MPI_COMM_WORLD, block->askRequests + direction);
+        MPI_Recv_init((void *)(block->answers + direction * MESSAGE_LENGTH), MESSAGE_LENGTH, MPI_INT,
+                      neighbours[direction], ANSWER, MPI_COMM_WORLD, block->askResponses + direction);
+    }
+}
+
+/**
+ * Free the persistent requests of a block, all of them must be finished.
+ * @param block
+ */
+void freeQuestions(questionBlock *block)
+{
+    int direction;
+    for (direction = 0; direction < DIRECTIONS; ++direction)
+    {
+        if (block->askRequests[direction] != MPI_REQUEST_NULL)
+        {
+            MPI_Request_free(block->askRequests + direction);
+            MPI_Request_free(block->askResponses + direction);
+        }
+    }
+}
+
+/**
+ * Ask the question of the block to the neighbour in the given direction, to calculate the sums for its portion of
+ * the asked positions' centers.
+ * This will start the ask request to notify the neighbour and the ask response to get the results from the
+ * neighbour, which will be available when the neighbour answers.
+ * @param block
+ * @param direction
+ * @param epoch own border flips visible to that neighbour
  */
-void askAsync(int neighbour, int position, MPI_Request *askRequests, int *askReqResCount,
-              MPI_Request *askResponses, int *askResponseValues)
+void askAsync(questionBlock *block, int direction, unsigned epoch)
 {
-    if (neighbour == -1)
+    int *questions = block->questions + direction * MESSAGE_LENGTH;
+    if (block->askRequests[direction] == MPI_REQUEST_NULL || block->counts[direction] == 0)
     {
-        // no neighbour in this direction
+        // no neighbour in this direction, or nothing to ask
         return;
     }
-    MPI_Isend((void *)&position, 1, MPI_INT, neighbour, QUESTION, MPI_COMM_WORLD, askRequests + (*askReqResCount));
-    MPI_Irecv((void *)(askResponseValues + (*askReqResCount)), 1, MPI_INT, neighbour, ANSWER,
-              MPI_COMM_WORLD, askResponses + (*askReqResCount));
-    ++(*askReqResCount);
+    questions[EPOCH_INDEX] = (int)epoch;
+    questions[COUNT_INDEX] = block->counts[direction];
+    MPI_Start(block->askRequests + direction);
+    MPI_Start(block->askResponses + direction);
 }
 
 /**
- * Check whether all ask requests & responses are finished by their neighbours so that the calculation can proceed.
- * @param askRequests
- * @param askReqResCount
- * @param askResponses
+ * Check whether all ask requests & responses of the block are finished by their neighbours so that the calculation
+ * can proceed (requests that were not started count as finished).
+ * @param block
  * @return
  */
-int testAskAll(MPI_Request *askRequests, int *askReqResCount, MPI_Request *askResponses)
+int testAskAll(questionBlock *block)
+{
+    int requestResult, responseResult;
+    MPI_Testall(DIRECTIONS, block->askRequests, &requestResult, MPI_STATUSES_IGNORE);
+    MPI_Testall(DIRECTIONS, block->askResponses, &responseResult, MPI_STATUSES_IGNORE);
+    return requestResult && responseResult;
+}
+
+/**
+ * Draw a block of random pixels and ask every neighbour about the block's pixels on its side.
+ * @param block
+ * @param size number of pixels, at most batchSize
+ * @param info
+ */
+void drawBlock(questionBlock *block, int size, answerInfo *info)
 {
-    int requestResult = 1, responseResult = 1;
-    if (*askReqResCount > 0)
+    int directions[DIRECTIONS], positions[DIRECTIONS], direction, i;
+    block->size = size;
+    block->answered = 0;
+    memset(block->counts, 0, sizeof(block->counts));
+    for (i = 0; i < size; ++i)
     {
-        MPI_Testall(*askReqResCount, askRequests, &requestResult, MPI_STATUSES_IGNORE);
-        MPI_Testall(*askReqResCount, askResponses, &responseResult, MPI_STATUSES_IGNORE);
+        block->rows[i] = rand() % info->rows;
+        block->columns[i] = rand() % info->columns;
+        int count = boundaryQuestions(block->rows[i], block->columns[i], info->rows, info->columns, info->neighbours,
+                                      directions, positions);
+        while (count--)
+        {
+            direction = directions[count];
+            block->questions[direction * MESSAGE_LENGTH + block->counts[direction]++] = positions[count];
+        }
     }
-    return requestResult && responseResult;
+    for (direction = 0; direction < DIRECTIONS; ++direction)
+    {
+        // only the compute thread changes the epochs, no lock needed to read them here
+        askAsync(block, direction, info->borderEpochs[direction]);
+    }
+}
+
+/**
+ * Wait until the neighbours answered all questions of the block, answering their questions meanwhile
+ * (unless the progress thread does).
+ * @param block
+ * @param info
+ * @param answerEpochs latest epoch of every neighbour heard in an answer, updated
+ */
+void waitBlock(questionBlock *block, answerInfo *info, unsigned *answerEpochs)
+{
+    int direction;
+    if (block->answered)
+    {
+        return;
+    }
+    if (info->progressThread)
+    {
+        MPI_Waitall(DIRECTIONS, block->askRequests, MPI_STATUSES_IGNORE);
+        MPI_Waitall(DIRECTIONS, block->askResponses, MPI_STATUSES_IGNORE);
+    }
+    while (!testAskAll(block))
+    {
+        /* answer neighbours' questions before waiting for answers for its questions -- prevents deadlock */
+        answerAll(info);
+        /* answer neighbours' questions done */
+    }
+    for (direction = 0; direction < DIRECTIONS; ++direction)
+    {
+        if (block->counts[direction] > 0)
+        {
+            answerEpochs[direction] = (unsigned)block->answers[direction * MESSAGE_LENGTH + EPOCH_INDEX];
+        }
+    }
+    block->answered = 1;
 }
 
 /**
- * Get the sum of all ask responses to use in the calculation process,
- * also reduce the number of ask requests/responses back to zero
- * @param askRequests
- * @param askReqResCount
- * @param askResponses
- * @param askResponseValues
+ * Check whether an answer with the given epoch may be stale, because the neighbour has told a newer epoch since.
+ * @param info
+ * @param answerEpochs
+ * @param direction
+ * @param epoch
  * @return
  */
-int askResult(MPI_Request *askRequests, int *askReqResCount, MPI_Request *askResponses, int *askResponseValues)
+int staleAnswer(answerInfo *info, unsigned *answerEpochs, int direction, unsigned epoch)
+{
+    return (int)(atomic_load(info->questionEpochs + direction) - epoch) > 0 ||
+           (int)(answerEpochs[direction] - epoch) > 0;
+}
+
+/**
+ * Ask a single position again and wait for the answer.
+ * @param info
+ * @param single block used for these questions
+ * @param answerEpochs
+ * @param direction
+ * @param position
+ * @return the sum of the neighbour's portion
+ */
+int askAgain(answerInfo *info, questionBlock *single, unsigned *answerEpochs, int direction, int position)
+{
+    memset(single->counts, 0, sizeof(single->counts));
+    single->counts[direction] = 1;
+    single->answered = 0;
+    single->questions[direction * MESSAGE_LENGTH] = position;
+    askAsync(single, direction, info->borderEpochs[direction]);
+    waitBlock(single, info, answerEpochs);
+    return single->answers[direction * MESSAGE_LENGTH];
+}
+
+/**
+ * Counters of a slave over the whole run.
+ */
+typedef struct samplerStats
+{
+    long long iterations;
+    long long flips;
+    long long prefetched;
+    long long reissued;
+} samplerStats;
+
+/**
+ * Wait for a nonblocking collective of the slaves while the neighbours' questions keep being answered (by the
+ * progress thread, or here).
+ * @param request
+ * @param info
+ */
+void waitWhileAnswering(MPI_Request *request, answerInfo *info)
 {
-    // called after a success testAskAll all ask requests and responses so it's certain that they all did finish.
-    int result = 0;
-    if ((*askReqResCount) > 0)
+    int flag = 0;
+    if (info->progressThread)
     {
-        ;
-        while (*askReqResCount)
+        MPI_Wait(request, MPI_STATUS_IGNORE);
+        return;
+    }
+    while (!flag)
+    {
+        // some slaves are not there yet, keep answering
+        answerAll(info);
+        MPI_Test(request, &flag, MPI_STATUS_IGNORE);
+    }
+}
+
+/**
+ * Run budget iterations of the sampler on the slave's portion, in blocks of batchSize random pixels.
+ * @param info
+ * @param blocks two blocks (one is used unless prefetching) and one for the questions asked again
+ * @param initialSubImage
+ * @param beta
+ * @param gammaValue
+ * @param budget
+ * @param prefetch ask the questions of the next block before working on the current one
+ * @param answerEpochs
+ * @param stats updated
+ * @param world_rank
+ * @param hn host name
+ * @return the number of flips
+ */
+long long sampleBlocks(answerInfo *info, questionBlock *blocks, char **initialSubImage, double beta, double gammaValue,
+                       long long budget, int prefetch, unsigned *answerEpochs, samplerStats *stats, int world_rank,
+                       const char *hn)
+{
+    char **subImage = info->subImage;
+    int rows = info->rows, columns = info->columns, progressThread = info->progressThread;
+    int cursors[DIRECTIONS], askDirections[DIRECTIONS], askPositions[DIRECTIONS], direction, i, current = 0;
+    int sharedDirections[DIRECTIONS], sharedPositions[DIRECTIONS];
+    long long undrawn = budget, flips = 0;
+    if (budget <= 0)
+    {
+        return 0;
+    }
+    /* pick a block of random pixels and ask the neighbours about them */
+    drawBlock(blocks, undrawn < batchSize ? undrawn : batchSize, info);
+    undrawn -= blocks[0].size;
+    while (budget > 0)
+    {
+        questionBlock *block = blocks + current;
+        if (info->window != MPI_WIN_NULL)
+        {
+            // publish the flips of the last block and see those of the neighbours on the node
+            MPI_Win_sync(info->window);
+        }
+        int next = prefetch ? 1 - current : current;
+        if (prefetch && undrawn > 0)
         {
-            --(*askReqResCount);
-            result += askResponseValues[(*askReqResCount)];
+            /* the questions of the next block are in flight while this one is worked on */
+            drawBlock(blocks + next, undrawn < batchSize ? undrawn : batchSize, info);
+            undrawn -= blocks[next].size;
         }
+        /* the answers of every direction are in the order of the pixels of the block */
+        memset(cursors, 0, sizeof(cursors));
+        for (i = 0; i < block->size; ++i)
+        {
+            --budget;
+            if (++stats->iterations % 1000000 == 0)
+            {
+                printf("slave %d (on node %s) started a new millionth iteration - done: %lld\n", world_rank, hn,
+                       stats->iterations);
+            }
+            int rowPosition = block->rows[i];
+            int columnPosition = block->columns[i];
+            /* sum neighbour cells */
+            int sum = summer(subImage, rows, columns, rowPosition, columnPosition);
+            int questionCount = boundaryQuestions(rowPosition, columnPosition, rows, columns, info->neighbours,
+                                                  askDirections, askPositions);
+            if (questionCount > 0)
+            {
+                /* interior pixels never wait for the neighbours */
+                waitBlock(block, info, answerEpochs);
+            }
+            int question;
+            for (question = 0; question < questionCount; ++question)
+            {
+                direction = askDirections[question];
+                int *answers = block->answers + direction * MESSAGE_LENGTH;
+                int answer = answers[cursors[direction]++];
+                if (prefetch)
+                {
+                    ++stats->prefetched;
+                    if (staleAnswer(info, answerEpochs, direction, (unsigned)answers[EPOCH_INDEX]))
+                    {
+                        // the neighbour flipped some of its border pixels since it answered
+                        answer = askAgain(info, blocks + 2, answerEpochs, direction, askPositions[question]);
+                        ++stats->reissued;
+                    }
+                }
+                sum += answer;
+            }
+            if (info->window != MPI_WIN_NULL)
+            {
+                int sharedCount = boundaryQuestions(rowPosition, columnPosition, rows, columns, info->sharedNeighbours,
+                                                    sharedDirections, sharedPositions);
+                while (sharedCount--)
+                {
+                    direction = sharedDirections[sharedCount];
+                    sum += portionSum(info->sharedPortions[direction], rows, columns, oppositeDirection(direction),
+                                      sharedPositions[sharedCount]);
+                }
+            }
+            /* sum neighbour cells done */
+            /* calculate delta_e */
+            // double deltaE = - 2 * subImage[rowPosition][columnPosition] * (gammaValue * initialSubImage[rowPosition][columnPosition] + beta * sum);
+            double deltaE = -2 * gammaValue * initialSubImage[rowPosition][columnPosition] * subImage[rowPosition][columnPosition] - 2 * beta * subImage[rowPosition][columnPosition] * sum;
+            // printf("delta: %f exp delta %f\n", deltaE, exp(deltaE));
+            // deltaE = log(accept_probability)  *** accept_probability can be bigger than 1, since we skipped Min(1, acc_prob) ***
+            if (log(randomProbability()) <= deltaE)
+            {
+                // if accepted, flip the pixel (the progress thread may be reading the border of the portion)
+                ++flips;
+                if (questionCount == 0)
+                {
+                    subImage[rowPosition][columnPosition] = -subImage[rowPosition][columnPosition];
+                    continue;
+                }
+                if (progressThread)
+                {
+                    pthread_mutex_lock(&info->borderLock);
+                }
+                subImage[rowPosition][columnPosition] = -subImage[rowPosition][columnPosition];
+                for (question = 0; question < questionCount; ++question)
+                {
+                    ++info->borderEpochs[askDirections[question]];
+                }
+                if (progressThread)
+                {
+                    pthread_mutex_unlock(&info->borderLock);
+                }
+            }
+        }
+        if (!prefetch && undrawn > 0)
+        {
+            drawBlock(blocks + next, undrawn < batchSize ? undrawn : batchSize, info);
+            undrawn -= blocks[next].size;
+        }
+        current = next;
     }
-    return result;
+    /* pick a block of random pixels done */
+    stats->flips += flips;
+    return flips;
+}
+
+/**
+ * Deterministic colour-phase sweeps of a tile (--seed): the fixed point updates of the Pthreads version with the
+ * random numbers of pixelRandom(), keyed by the global coordinates, so that the result for a seed does not depend on
+ * the decomposition. Instead of the query protocol the tile keeps a halo of one pixel around it (0 outside of the
+ * image, which adds nothing to the sums), refreshed from the neighbours after every colour phase with persistent
+ * requests: during a phase only the pixels of one colour change, and they never read each other.
+ * @param image
+ * @param lattice updated in place
+ * @param rows
+ * @param columns
+ * @param neighbours
+ * @param offsets global row and column of the first pixel of the tile
+ * @param sweeps
+ * @param seed
+ * @param memory
+ * @return the number of flips, -1 without memory
+ */
+long long haloSweeps(char **image, char **lattice, int rows, int columns, const int *neighbours, const int *offsets,
+                     int sweeps, uint64_t seed, arena *memory)
+{
+    int paddedRows = rows + 2, paddedColumns = columns + 2;
+    char *imageData = (char *)arenaAlloc(memory, (size_t)paddedRows * paddedColumns);
+    char *latticeData = (char *)arenaAlloc(memory, (size_t)paddedRows * paddedColumns);
+    char **paddedImage = imageData ? rowPointers(memory, imageData, paddedRows, paddedColumns) : NULL;
+    char **paddedLattice = latticeData ? rowPointers(memory, latticeData, paddedRows, paddedColumns) : NULL;
+    if (!paddedImage || !paddedLattice)
+    {
+        return -1;
+    }
+    int i, direction, count = 0;
+    memset(imageData, 0, (size_t)paddedRows * paddedColumns);
+    memset(latticeData, 0, (size_t)paddedRows * paddedColumns);
+    for (i = 0; i < rows; ++i)
+    {
+        memcpy(paddedImage[i + 1] + 1, image[i], columns);
+        memcpy(paddedLattice[i + 1] + 1, lattice[i], columns);
+    }
+
+    /* the border on every side is sent to the neighbour there, and its border is received in the halo of that side */
+    MPI_Datatype column;
+    MPI_Type_vector(rows, 1, paddedColumns, MPI_BYTE, &column);
+    MPI_Type_commit(&column);
+    MPI_Request requests[2 * DIRECTIONS];
+    for (direction = 0; direction < DIRECTIONS; ++direction)
+    {
+        if (neighbours[direction] == -1)
+        {
+            continue;
+        }
+        int top = direction == TOP || direction == TOP_LEFT || direction == TOP_RIGHT;
+        int bottom = direction == BOTTOM || direction == BOTTOM_LEFT || direction == BOTTOM_RIGHT;
+        int left = direction == LEFT || direction == TOP_LEFT || direction == BOTTOM_LEFT;
+        int right = direction == RIGHT || direction == TOP_RIGHT || direction == BOTTOM_RIGHT;
+        int borderRow = bottom ? rows : 1, borderColumn = right ? columns : 1;
+        int haloRow = top ? 0 : bottom ? rows + 1 : 1, haloColumn = left ? 0 : right ? columns + 1 : 1;
+        // a whole row for TOP and BOTTOM, a whole column for LEFT and RIGHT, a single pixel for the corners
+        int length = direction == TOP || direction == BOTTOM ? columns : 1;
+        MPI_Datatype type = direction == LEFT || direction == RIGHT ? column : MPI_BYTE;
+        MPI_Send_init(paddedLattice[borderRow] + borderColumn, length, type, neighbours[direction], HALO + direction,
+                      MPI_COMM_WORLD, requests + count++);
+        MPI_Recv_init(paddedLattice[haloRow] + haloColumn, length, type, neighbours[direction],
+                      HALO + oppositeDirection(direction), MPI_COMM_WORLD, requests + count++);
+    }
+
+    pixelKey key = {seed, 0, offsets[0] - 1, offsets[1] - 1};
+    int colors = (neighbourhood->radius + 1) * (neighbourhood->radius + 1), color;
+    long long flips = 0;
+    MPI_Startall(count, requests);
+    MPI_Waitall(count, requests, MPI_STATUSES_IGNORE);
+    for (key.sweep = 0; key.sweep < (uint64_t)sweeps; ++key.sweep)
+    {
+        for (color = 0; color < colors; ++color)
+        {
+            flips += sweepTile(paddedImage, paddedLattice, paddedRows, paddedColumns, 1, rows + 1, 1, columns + 1,
+                               color, neighbourhood, NULL, &key);
+            MPI_Startall(count, requests);
+            MPI_Waitall(count, requests, MPI_STATUSES_IGNORE);
+        }
+    }
+    for (i = 0; i < count; ++i)
+    {
+        MPI_Request_free(requests + i);
+    }
+    MPI_Type_free(&column);
+    for (i = 0; i < rows; ++i)
+    {
+        memcpy(lattice[i], paddedLattice[i + 1] + 1, columns);
+    }
+    return flips;
+}
+
+/**
+ * Send the final rows of a slave to the master, run-length encoded (see encodeRleRow()): a denoised document is
+ * mostly long runs, so a row shrinks to a few bytes.
+ * @param subImage
+ * @param rows
+ * @param columns
+ */
+void sendFinalRows(char **subImage, int rows, int columns)
+{
+    unsigned char *encoded = (unsigned char *)malloc(RLE_ROW_BOUND(columns));
+    int i;
+    if (!encoded)
+    {
+        fprintf(stderr, "Not enough memory to encode the final rows\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < rows; ++i)
+    {
+        sendMessage(encoded, encodeRleRow(subImage[i], columns, encoded), MPI_BYTE, MASTER_RANK, FINAL_IMAGE_START + i);
+    }
+    free(encoded);
 }
 
 /**
  * logic for slave request
  *
- * @param world_size
  * @param world_rank
  * @param beta
  * @param gammaValue
+ * @param progressThread answer the neighbours from a dedicated thread instead of polling in the compute loop
+ * @param prefetch ask the questions of the next block before working on the current one
+ * @param slaves communicator of the slaves only, for the termination barrier and the budgets
+ * @param sweeps iterations per pixel of the slave's tile, 0 for the default
+ * @param rebalance move the budget toward the tiles that are still changing after every sweep of the whole image
+ * @param sharedMemory read the portions of the neighbours on the same node directly
+ * @param seed NULL, or the seed of the deterministic halo exchange sweeps (see haloSweeps())
  * @return
  */
-int slave(int world_size, int world_rank, double beta, double gammaValue)
+int slave(int world_rank, double beta, double gammaValue, int progressThread, int prefetch, MPI_Comm slaves,
+          double sweeps, int rebalance, int sharedMemory, const uint64_t *seed)
 {
 
     char hn[99];
-    int iterations = TOTAL_ITERATIONS / (world_size - 1);
 
     int rows, columns;
     receiveMessage(&rows, 1, MPI_INT, MASTER_RANK, ROWS);
     receiveMessage(&columns, 1, MPI_INT, MASTER_RANK, COLUMNS);
+    int offsets[2];
+    receiveMessage(offsets, 2, MPI_INT, MASTER_RANK, TILE_OFFSET);
 
     int neighbours[DIRECTIONS], direction;
     for (direction = 0; direction < DIRECTIONS; ++direction)
@@ -351,111 +985,231 @@ int slave(int world_size, int world_rank, double beta, double gammaValue)
         receiveMessage(neighbours + direction, 1, MPI_INT, MASTER_RANK, direction);
     }
 
-    char *subImage[rows], initialSubImage[rows][columns];
+    arena memory = {NULL};
+    MPI_Comm node = MPI_COMM_NULL;
+    MPI_Win window = MPI_WIN_NULL;
+    char *subImageData = sharedMemory ? allocateSharedPortion(slaves, rows, columns, &node, &window)
+                                      : (char *)arenaAlloc(&memory, (size_t)rows * columns);
+    char **subImage = subImageData ? rowPointers(&memory, subImageData, rows, columns) : NULL;
+    char *initialData = (char *)arenaAlloc(&memory, (size_t)rows * columns);
+    char **initialSubImage = initialData ? rowPointers(&memory, initialData, rows, columns) : NULL;
+    if (!subImage || !initialSubImage)
+    {
+        fprintf(stderr, "Not enough memory for a %d x %d sub image\n", rows, columns);
+        return 1;
+    }
     int i;
     for (i = 0; i < rows; ++i)
     {
         receiveMessage(initialSubImage[i], columns, MPI_BYTE, MASTER_RANK, IMAGE_START + i);
-        subImage[i] = (char *)malloc(columns * sizeof(char));
         memcpy(subImage[i], initialSubImage[i], columns);
     }
+    gethostname(hn, 99);
 
-    MPI_Request askRequests[DIRECTIONS];
-    MPI_Request askResponses[DIRECTIONS];
-    MPI_Request answerRequests[DIRECTIONS];
-    MPI_Request answerResponses[DIRECTIONS];
-    MPI_Request finishedRequests[DIRECTIONS];
-    MPI_Request finishedResponses[DIRECTIONS];
-    int positions[DIRECTIONS];
-    int askResponseValues[DIRECTIONS];
+    if (seed)
+    {
+        /* whole sweeps, as many as in the sequential and Pthreads versions */
+        long long pixels = (long long)rows * columns, totalPixels;
+        MPI_Allreduce(&pixels, &totalPixels, 1, MPI_LONG_LONG, MPI_SUM, slaves);
+        int seededSweeps = sweeps > 0 ? (int)sweeps : (int)(TOTAL_ITERATIONS / totalPixels);
+        seededSweeps = seededSweeps > 0 ? seededSweeps : 1;
+        fillThresholds(beta, gammaValue, neighbourhood->totalWeight);
+        long long flips = haloSweeps(initialSubImage, subImage, rows, columns, neighbours, offsets, seededSweeps,
+                                     *seed, &memory);
+        if (flips < 0)
+        {
+            fprintf(stderr, "Not enough memory for the halo of a %d x %d sub image\n", rows, columns);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        sendFinalRows(subImage, rows, columns);
+        arenaRelease(&memory);
+        printf("slave %d ran %d deterministic sweeps of its %d x %d tile, %lld flips (on node %s).\n", world_rank,
+               seededSweeps, rows, columns, flips, hn);
+        return 0;
+    }
 
-    int askReqResCount = 0, finishedReqResCount = 0;
+    /* MESSAGE_LENGTH entries per direction: asked positions and their answers, both ways, and two blocks for --prefetch */
+    answerInfo info = {.subImage = subImage, .rows = rows, .columns = columns, .neighbours = neighbours,
+                       .progressThread = progressThread, .window = window};
+    questionBlock blocks[3]; /* two blocks for --prefetch, and one for the questions asked again */
+    info.positions = (int *)arenaAlloc(&memory, 8 * DIRECTIONS * MESSAGE_LENGTH * sizeof(int));
+    int *blockPixels = (int *)arenaAlloc(&memory, 4 * batchSize * sizeof(int));
+    if (!info.positions || !blockPixels)
+    {
+        fprintf(stderr, "Not enough memory for batches of %d pixels\n", batchSize);
+        return 1;
+    }
+    info.sums = info.positions + DIRECTIONS * MESSAGE_LENGTH;
+    if (sharedMemory)
+    {
+        // before the requests are initialized: the neighbours on the node are never asked
+        shareNeighbours(&info, node, &memory);
+        MPI_Win_sync(window);
+    }
+    for (i = 0; i < 3; ++i)
+    {
+        blocks[i].questions = info.positions + (2 + 2 * i) * DIRECTIONS * MESSAGE_LENGTH;
+        blocks[i].answers = blocks[i].questions + DIRECTIONS * MESSAGE_LENGTH;
+        blocks[i].rows = i < 2 ? blockPixels + 2 * i * batchSize : NULL;
+        blocks[i].columns = i < 2 ? blocks[i].rows + batchSize : NULL;
+        initializeQuestions(blocks + i, neighbours);
+    }
+    unsigned answerEpochs[DIRECTIONS] = {0};
+    samplerStats stats = {0, 0, 0, 0};
 
-    gethostname(hn, 99);
+    /* the budget is given in sweeps per pixel, the default keeps the old total of TOTAL_ITERATIONS */
+    long long pixels = (long long)rows * columns, totalPixels;
+    MPI_Allreduce(&pixels, &totalPixels, 1, MPI_LONG_LONG, MPI_SUM, slaves);
+    double sweepsPerPixel = sweeps > 0 ? sweeps : (double)TOTAL_ITERATIONS / totalPixels;
+    long long globalBudget = (long long)llround(sweepsPerPixel * totalPixels);
 
     /* initialize all answer requests (Irecv for all neighbours for potentials questions in later) */
-    initializeAnswers(neighbours, positions, answerRequests, answerResponses);
+    initializeAnswers(&info);
     /* initialize all answer requests done */
-    while (iterations--)
+    pthread_t progress;
+    pthread_mutex_init(&info.borderLock, NULL);
+    if (progressThread)
     {
-        if (iterations % 1000000 == 0)
-        {
-            printf("slave %d (on node %s) started a new millionth iteration - left: %d\n", world_rank, hn, iterations);
-        }
-        /* pick a random pixel */
-        int rowPosition = rand() % rows;
-        int columnPosition = rand() % columns;
-
-        // printf("selected pixel %d / %d  --  %d / %d\n", rowPosition, rows, columnPosition, columns);
-        /* pick a random pixel done */
-        /* sum neighbour cells */
-        int sum = summer(subImage, rows, columns, rowPosition, columnPosition);
-        if (rowPosition == 0)
+        MPI_Irecv(NULL, 0, MPI_INT, world_rank, STOP_PROGRESS, MPI_COMM_WORLD, info.answerRequests + DIRECTIONS);
+        if (pthread_create(&progress, NULL, progressWorker, &info) != 0)
         {
-            askAsync(neighbours[TOP], columnPosition, askRequests, &askReqResCount, askResponses, askResponseValues);
-            if (columnPosition == 0)
-            {
-                askAsync(neighbours[TOP_LEFT], 0, askRequests, &askReqResCount, askResponses, askResponseValues);
-            }
-            if (columnPosition == columns - 1)
-            {
-                askAsync(neighbours[TOP_RIGHT], 0, askRequests, &askReqResCount, askResponses, askResponseValues);
-            }
+            fprintf(stderr, "Cannot create the progress thread\n");
+            return 1;
         }
-        if (rowPosition == rows - 1)
+    }
+    /* run the budget, one round (one sweep of the whole image) at a time when rebalancing */
+    long long roundTotal = rebalance ? totalPixels : globalBudget, left = globalBudget, flips = 0;
+    long long budget = (long long)llround((double)rows * columns * roundTotal / totalPixels);
+    while (left > 0)
+    {
+        if (roundTotal > left)
         {
-            askAsync(neighbours[BOTTOM], columnPosition, askRequests, &askReqResCount, askResponses, askResponseValues);
-            if (columnPosition == 0)
-            {
-                askAsync(neighbours[BOTTOM_LEFT], 0, askRequests, &askReqResCount, askResponses, askResponseValues);
-            }
-            if (columnPosition == columns - 1)
-            {
-                askAsync(neighbours[BOTTOM_RIGHT], 0, askRequests, &askReqResCount, askResponses, askResponseValues);
-            }
+            budget = budget * left / roundTotal;
+            roundTotal = left;
         }
-        if (columnPosition == 0)
+        flips = sampleBlocks(&info, blocks, initialSubImage, beta, gammaValue, budget, prefetch, answerEpochs, &stats,
+                             world_rank, hn);
+        left -= roundTotal;
+        if (rebalance && left > 0)
         {
-            askAsync(neighbours[LEFT], rowPosition, askRequests, &askReqResCount, askResponses, askResponseValues);
+            /* move the budget of the next round toward the tiles that are still changing */
+            long long allFlips;
+            MPI_Request reduced;
+            MPI_Iallreduce(&flips, &allFlips, 1, MPI_LONG_LONG, MPI_SUM, slaves, &reduced);
+            waitWhileAnswering(&reduced, &info);
+            budget = (long long)llround((double)roundTotal * (flips + (double)rows * columns / REBALANCE_FLOOR) /
+                                        (allFlips + (double)totalPixels / REBALANCE_FLOOR));
         }
-        if (columnPosition == columns - 1)
+    }
+    /* pick a block of random pixels done */
+    // dont finish yet, instead wait until all slaves also finish: a slave enters the barrier only once all of its
+    // questions are answered, so when the barrier completes nobody can ask anything anymore
+    MPI_Request finished;
+    MPI_Ibarrier(slaves, &finished);
+    waitWhileAnswering(&finished, &info);
+    if (progressThread)
+    {
+        // the progress thread kept answering, it can be stopped now
+        sendMessage(NULL, 0, MPI_INT, world_rank, STOP_PROGRESS);
+        pthread_join(progress, NULL);
+    }
+    else
+    {
+        stopAnswering(&info);
+    }
+    for (i = 0; i < 3; ++i)
+    {
+        freeQuestions(blocks + i);
+    }
+
+    sendFinalRows(subImage, rows, columns);
+    if (sharedMemory)
+    {
+        MPI_Win_unlock_all(window);
+        MPI_Win_free(&window);
+        MPI_Comm_free(&node);
+    }
+    arenaRelease(&memory);
+    printf("slave %d ran %lld iterations (%.2f sweeps of its %d x %d tile), %lld flips.\n", world_rank,
+           stats.iterations, (double)stats.iterations / ((double)rows * columns), rows, columns, stats.flips);
+    if (prefetch)
+    {
+        printf("slave %d asked again %lld of %lld prefetched neighbour sums.\n", world_rank, stats.reissued,
+               stats.prefetched);
+    }
+    printf("slave %d finished its work end exited successfully (on node %s).\n", world_rank, hn);
+    return 0;
+}
+
+/**
+ * Receive the final rows from the slaves in whatever order they arrive and write every piece straight to its place
+ * in the (fixed width) output file, so that the master never holds the whole image: at most GATHER_WINDOW pieces of
+ * columnsPerSlave pixels are in flight at any time, received with persistent requests.
+ * The pieces arrive run-length encoded (see sendFinalRows()), the slave rank and the tag of a piece tell where it
+ * belongs.
+ * @param outputFile
+ * @param rowCount
+ * @param columnCount
+ * @param rowsPerSlave
+ * @param columnsPerSlave
+ * @param slavesPerRow
+ * @return 0 on success, 1 if the output could not be written
+ */
+int gatherResults(int outputFile, int rowCount, int columnCount, int rowsPerSlave, int columnsPerSlave, int slavesPerRow)
+{
+    long long pieceCount = (long long)rowCount * slavesPerRow, posted = 0, received = 0;
+    int window = pieceCount < GATHER_WINDOW ? (int)pieceCount : GATHER_WINDOW;
+    MPI_Request requests[GATHER_WINDOW];
+    size_t bound = RLE_ROW_BOUND(columnsPerSlave);
+    unsigned char *pieces = (unsigned char *)malloc((size_t)window * bound);
+    char *piece = (char *)malloc(columnsPerSlave);
+    char *text = (char *)malloc(3 * (size_t)columnsPerSlave + 1);
+    int error = 0, slot, size;
+    if (!pieces || !piece || !text)
+    {
+        free(pieces);
+        free(piece);
+        free(text);
+        return 1;
+    }
+    for (slot = 0; slot < window; ++slot, ++posted)
+    {
+        MPI_Recv_init(pieces + (size_t)slot * bound, (int)bound, MPI_BYTE, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
+                      requests + slot);
+    }
+    MPI_Startall(window, requests);
+    while (received < pieceCount)
+    {
+        MPI_Status status;
+        MPI_Waitany(window, requests, &slot, &status);
+        int slaveIndex = status.MPI_SOURCE - 1;
+        int rowNumber = (slaveIndex / slavesPerRow) * rowsPerSlave + status.MPI_TAG - FINAL_IMAGE_START;
+        int columnNumber = (slaveIndex % slavesPerRow) * columnsPerSlave;
+        MPI_Get_count(&status, MPI_BYTE, &size);
+        if (decodeRleRow(pieces + (size_t)slot * bound, size, piece, columnsPerSlave) != 0)
         {
-            askAsync(neighbours[RIGHT], rowPosition, askRequests, &askReqResCount, askResponses, askResponseValues);
+            fprintf(stderr, "Invalid row %d from slave %d\n", rowNumber, slaveIndex + 1);
+            error = 1;
         }
-        while (!testAskAll(askRequests, &askReqResCount, askResponses))
+        else
         {
-            /* answer neighbours' questions before waiting for answers for its questions -- prevents deadlock */
-            answerAll(subImage, rows, columns, neighbours, positions, answerRequests, answerResponses);
-            /* answer neighbours' questions done */
+            error |= writeTextPiece(outputFile, piece, rowNumber, columnNumber, columnsPerSlave, columnCount, text);
         }
-        sum += askResult(askRequests, &askReqResCount, askResponses, askResponseValues);
-        /* sum neighbour cells done */
-        /* calculate delta_e */
-        // double deltaE = - 2 * subImage[rowPosition][columnPosition] * (gammaValue * initialSubImage[rowPosition][columnPosition] + beta * sum);
-        double deltaE = -2 * gammaValue * initialSubImage[rowPosition][columnPosition] * subImage[rowPosition][columnPosition] - 2 * beta * subImage[rowPosition][columnPosition] * sum;
-        // printf("delta: %f exp delta %f\n", deltaE, exp(deltaE));
-        // deltaE = log(accept_probability)  *** accept_probability can be bigger than 1, since we skipped Min(1, acc_prob) ***
-        if (log(randomProbability()) <= deltaE)
+        ++received;
+        if (posted < pieceCount)
         {
-            // if accepted, flip the pixel
-            subImage[rowPosition][columnPosition] = -subImage[rowPosition][columnPosition];
+            MPI_Start(requests + slot);
+            ++posted;
         }
     }
-    // dont finish yet, instead wait until all neighbours also finish
-    sendFinishedAll(neighbours, finishedRequests, finishedResponses, &finishedReqResCount);
-    while (!testFinishedAll(neighbours, finishedRequests, finishedResponses, &finishedReqResCount))
-    {
-        // some neighbours are not finished yet, keep answering
-        answerAll(subImage, rows, columns, neighbours, positions, answerRequests, answerResponses);
-    }
-
-    for (i = 0; i < rows; ++i)
+    for (slot = 0; slot < window; ++slot)
     {
-        sendMessage(subImage[i], columns, MPI_BYTE, MASTER_RANK, FINAL_IMAGE_START + i);
-        free(subImage[i]);
+        MPI_Request_free(requests + slot);
     }
-    printf("slave %d finished its work end exited successfully (on node %s).\n", world_rank, hn);
-    return 0;
+    free(pieces);
+    free(piece);
+    free(text);
+    return error;
 }
 
 /**
@@ -471,49 +1225,33 @@ int slave(int world_size, int world_rank, double beta, double gammaValue)
 int master(int world_size, int world_rank, char *input, char *output, int grid)
 {
 
-    FILE *inputFile, *outputFile;
-    inputFile = fopen(input, "r");
-
-    queue *rowQueue = newQueue();
-    int rowCount = 0;
-    int columnCount = 0;
-
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
-
-    while ((read = getline(&line, &len, inputFile)) != -1)
+    int rowCount, columnCount;
+    if (isCompressedPath(output))
     {
-        int i, cursor = 0, nextCursor, nextPixel;
-        char *row = NULL;
-        if (columnCount == 0)
-        {
-            queue *columnQueue = newQueue();
-            while (sscanf(line + cursor, "%d%n", &nextPixel, &nextCursor) > 0)
-            {
-                cursor += nextCursor;
-                ++columnCount;
-                push(columnQueue, (void *)nextPixel);
-            }
-            row = (char *)malloc(columnCount * sizeof(char));
-            for (i = 0; i < columnCount; ++i)
-            {
-                row[i] = (char)pop(columnQueue);
-            }
-            freeQueue(columnQueue);
-        }
-        else
+        fprintf(stderr, "The pieces of the output are written in any order, it cannot be compressed\n");
+        return 1;
+    }
+    if (isRlePath(output))
+    {
+        fprintf(stderr, "The master writes text images, use the job farm for RLE outputs\n");
+        return 1;
+    }
+    /* only the size is read here, the rows are streamed to the slaves below so that the image is never held whole */
+    int runLength = isRlePath(input);
+    FILE *inputFile = openImageStream(input, "r");
+    if (!inputFile)
+    {
+        fprintf(stderr, "Cannot open the input file \"%s\"\n", input);
+        return 1;
+    }
+    if (runLength ? readRleHeader(inputFile, &rowCount, &columnCount) : textImageSize(input, &rowCount, &columnCount))
+    {
+        if (runLength)
         {
-            row = (char *)malloc(columnCount * sizeof(char));
-            i = 0;
-            while (sscanf(line + cursor, "%d%n", &nextPixel, &nextCursor) > 0)
-            {
-                cursor += nextCursor;
-                row[i++] = (char)nextPixel;
-            }
+            fprintf(stderr, "\"%s\" is not a valid RLE image\n", input);
         }
-        ++rowCount;
-        push(rowQueue, (void *)row);
+        fclose(inputFile);
+        return 1;
     }
 
     int slaveCount = world_size - 1;
@@ -528,6 +1266,7 @@ int master(int world_size, int world_rank, char *input, char *output, int grid)
         {
             fprintf(stderr, "Error (Grid Mode): rowCount or columnCount is not divisible "
                             "by the square root of slave count, \"sqrt(world_size - 1)\"\n");
+            fclose(inputFile);
             return 1;
         }
     }
@@ -541,6 +1280,8 @@ int master(int world_size, int world_rank, char *input, char *output, int grid)
             fprintf(stderr, "Error (Row Mode): rowCount is not divisible by the slave count, "
                             "\"world_size - 1\" = %d where row count is %d\n",
                     world_size - 1, rowCount);
+            fclose(inputFile);
+            return 1;
         }
     }
 
@@ -552,6 +1293,8 @@ int master(int world_size, int world_rank, char *input, char *output, int grid)
     {
         sendMessage(&rowsPerSlave, 1, MPI_INT, slaveRank, ROWS);
         sendMessage(&columnsPerSlave, 1, MPI_INT, slaveRank, COLUMNS);
+        int offsets[2] = {(slaveRank - 1) / slavesPerRow * rowsPerSlave, (slaveRank - 1) % slavesPerRow * columnsPerSlave};
+        sendMessage(offsets, 2, MPI_INT, slaveRank, TILE_OFFSET);
         int top = slaveRank <= slavesPerRow ? -1 : slaveRank - slavesPerRow;
         int right = slaveRank % slavesPerRow == 0 ? -1 : slaveRank + 1;
         int bottom = slaveRank > slaveCount - slavesPerRow ? -1 : slaveRank + slavesPerRow;
@@ -570,10 +1313,19 @@ int master(int world_size, int world_rank, char *input, char *output, int grid)
         sendMessage(&bottomLeft, 1, MPI_INT, slaveRank, BOTTOM_LEFT);
         sendMessage(&topLeft, 1, MPI_INT, slaveRank, TOP_LEFT);
     }
-    char *row;
-    int rowNumber = 0, slaveRowNumber, columnNumber;
-    while ((row = (char *)pop(rowQueue)))
+    char *row = (char *)malloc(columnCount);
+    unsigned char *encoded = runLength ? (unsigned char *)malloc(RLE_ROW_BOUND(columnCount)) : NULL;
+    char *line = NULL;
+    size_t len = 0;
+    int rowNumber, columnNumber;
+    for (rowNumber = 0; rowNumber < rowCount; ++rowNumber)
     {
+        if (runLength ? readRleRow(inputFile, encoded, row, columnCount)
+                      : readTextRow(inputFile, &line, &len, row, columnCount) <= 0)
+        {
+            fprintf(stderr, "Cannot read row %d of \"%s\"\n", rowNumber, input);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
         int slaveRankStart = (rowNumber / rowsPerSlave) * slavesPerRow + 1;
         int slaveRowNumber = rowNumber % rowsPerSlave;
         for (columnNumber = 0; columnNumber < columnCount; columnNumber += columnsPerSlave)
@@ -581,41 +1333,327 @@ int master(int world_size, int world_rank, char *input, char *output, int grid)
             slaveRank = slaveRankStart + columnNumber / columnsPerSlave;
             sendMessage(row + columnNumber, columnsPerSlave, MPI_BYTE, slaveRank, IMAGE_START + slaveRowNumber);
         }
-        free(row);
-        ++rowNumber;
     }
-    freeQueue(rowQueue);
+    free(line);
+    free(encoded);
+    free(row);
+    fclose(inputFile);
     printf("All slaves received their input from master, and starting working.\n");
 
-    char finalResult[rowCount][columnCount];
-    for (rowNumber = 0; rowNumber < rowCount; ++rowNumber)
+    int outputFile = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outputFile < 0)
     {
-        for (columnNumber = 0; columnNumber < columnCount; columnNumber += columnsPerSlave)
+        fprintf(stderr, "Cannot open the output file \"%s\"\n", output);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (gatherResults(outputFile, rowCount, columnCount, rowsPerSlave, columnsPerSlave, slavesPerRow))
+    {
+        fprintf(stderr, "Cannot write the output file \"%s\"\n", output);
+        close(outputFile);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    close(outputFile);
+
+    // papi_time_stop = PAPI_get_real_usec();
+
+    printf("finished successfully!\n");
+
+    // printf("Running time for %d processors: %dus\n", world_size, papi_time_stop - papi_time_start);
+    return 0;
+}
+
+/**
+ * @param path
+ * @return the file name of the path, without its directory
+ */
+const char *fileName(const char *path)
+{
+    return strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+}
+
+int compareFileNames(const void *a, const void *b)
+{
+    return strcmp(fileName(*(char *const *)a), fileName(*(char *const *)b));
+}
+
+/**
+ * Read the image list of the job farm (one input path per line, empty lines are skipped) and check it before any
+ * work starts: every path must fit in FARM_PATH_MAX, and since the outputs are named after the file name of their
+ * input only, two inputs with the same file name in different directories would overwrite each other's output.
+ * @param list
+ * @param count set to the number of images
+ * @return the paths, or NULL (an error is printed)
+ */
+char **readImageList(const char *list, int *count)
+{
+    *count = 0;
+    FILE *listFile = fopen(list, "r");
+    if (!listFile)
+    {
+        fprintf(stderr, "Cannot open the image list \"%s\"\n", list);
+        return NULL;
+    }
+    char **images = NULL, *line = NULL;
+    size_t len = 0;
+    int capacity = 0, valid = 1, i;
+    while (getline(&line, &len, listFile) != -1)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0])
+        {
+            continue;
+        }
+        if (strlen(line) >= FARM_PATH_MAX)
         {
-            slaveRank = (rowNumber / rowsPerSlave) * slavesPerRow + columnNumber / columnsPerSlave + 1;
-            slaveRowNumber = rowNumber % rowsPerSlave;
-            receiveMessage(finalResult[rowNumber] + columnNumber, columnsPerSlave,
-                           MPI_BYTE, slaveRank, FINAL_IMAGE_START + slaveRowNumber);
+            fprintf(stderr, "The image path \"%.64s...\" is longer than %d characters\n", line, FARM_PATH_MAX - 1);
+            valid = 0;
+            break;
         }
+        if (*count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            char **grown = (char **)realloc(images, capacity * sizeof(char *));
+            valid = grown != NULL;
+            images = grown ? grown : images;
+        }
+        if (!valid || !(images[*count] = strdup(line)))
+        {
+            fprintf(stderr, "Not enough memory for the image list \"%s\"\n", list);
+            valid = 0;
+            break;
+        }
+        ++*count;
     }
+    free(line);
+    fclose(listFile);
 
-    printf("finished calculations and communciations, started writing to output\n");
+    char **sorted = valid ? (char **)malloc((*count + 1) * sizeof(char *)) : NULL;
+    if (valid && !sorted)
+    {
+        fprintf(stderr, "Not enough memory for the image list \"%s\"\n", list);
+        valid = 0;
+    }
+    if (sorted)
+    {
+        memcpy(sorted, images, *count * sizeof(char *));
+        qsort(sorted, *count, sizeof(char *), compareFileNames);
+        for (i = 1; i < *count; ++i)
+        {
+            if (compareFileNames(sorted + i - 1, sorted + i) == 0)
+            {
+                fprintf(stderr, "\"%s\" and \"%s\" would be written to the same output file\n", sorted[i - 1],
+                        sorted[i]);
+                valid = 0;
+            }
+        }
+        free(sorted);
+    }
+    if (!valid)
+    {
+        for (i = 0; i < *count; ++i)
+        {
+            free(images[i]);
+        }
+        free(images);
+        *count = 0;
+        return NULL;
+    }
+    return images;
+}
 
-    // papi_time_stop = PAPI_get_real_usec();
+/**
+ * Job farm master: hand out the images of a list (see readImageList()) to the workers as they ask for work, and stop
+ * every worker once the list is exhausted, or right away if the list is not valid.
+ * A worker asks with a JOB_REQUEST carrying the outcome of its previous image ({-1, 0} for its first request,
+ * otherwise {status, flips}), the master replies with the next path, or an empty one to stop it.
+ * @param world_size
+ * @param list
+ * @return 0 if every image was denoised
+ */
+int farmMaster(int world_size, const char *list)
+{
+    int imageCount = 0;
+    char **images = readImageList(list, &imageCount);
+    int current[world_size]; /* image each worker is working on, -1 for none */
+    int stopped = 0, next = 0, failed = images == NULL, i;
+    double start = MPI_Wtime();
+    for (i = 0; i < world_size; ++i)
+    {
+        current[i] = -1;
+    }
+    while (stopped < world_size - 1)
+    {
+        long long outcome[2];
+        MPI_Status status;
+        MPI_Recv(outcome, 2, MPI_LONG_LONG, MPI_ANY_SOURCE, JOB_REQUEST, MPI_COMM_WORLD, &status);
+        int worker = status.MPI_SOURCE;
+        if (current[worker] >= 0)
+        {
+            printf("%s %s by worker %d (%lld flips)\n", images[current[worker]], outcome[0] ? "FAILED" : "denoised",
+                   worker, outcome[1]);
+            failed += outcome[0] != 0;
+            current[worker] = -1;
+        }
+        if (next == imageCount)
+        {
+            sendMessage("", 1, MPI_CHAR, worker, JOB);
+            ++stopped;
+            continue;
+        }
+        current[worker] = next;
+        sendMessage(images[next], strlen(images[next]) + 1, MPI_CHAR, worker, JOB);
+        ++next;
+    }
+    if (images)
+    {
+        printf("%d images denoised by %d workers in %.3fs, %d failed.\n", imageCount - failed, world_size - 1,
+               MPI_Wtime() - start, failed);
+    }
+    for (i = 0; i < imageCount; ++i)
+    {
+        free(images[i]);
+    }
+    free(images);
+    return failed != 0;
+}
 
-    outputFile = fopen(output, "w");
-    for (rowNumber = 0; rowNumber < rowCount; ++rowNumber)
+/**
+ * Denoise one image of the job farm with the colour-phase sweeps of the pthreads version, and write it to the output
+ * directory under the same file name.
+ * @param input
+ * @param outputDirectory
+ * @param sweeps per pixel, 0 for the TOTAL_ITERATIONS default
+ * @param threads
+ * @param seed NULL, or the seed of the deterministic sweeps
+ * @param flips set to the number of flips
+ * @return 0 on success
+ */
+int farmImage(const char *input, const char *outputDirectory, int sweeps, int threads, const uint64_t *seed,
+              long long *flips)
+{
+    arena memory = {NULL};
+    int rowCount, columnCount, row, error = 0;
+    *flips = 0;
+    char *pixels = readImage(&memory, input, &rowCount, &columnCount);
+    if (!pixels)
+    {
+        return 1;
+    }
+    char *latticeData = (char *)arenaAlloc(&memory, (size_t)rowCount * columnCount);
+    char **image = rowPointers(&memory, pixels, rowCount, columnCount);
+    char **lattice = latticeData ? rowPointers(&memory, latticeData, rowCount, columnCount) : NULL;
+    char *text = (char *)arenaAlloc(&memory, 3 * (size_t)columnCount + 1);
+    if (!image || !lattice || !text)
+    {
+        fprintf(stderr, "Not enough memory for \"%s\"\n", input);
+        arenaRelease(&memory);
+        return 1;
+    }
+    if (sweeps <= 0)
+    {
+        sweeps = TOTAL_ITERATIONS / ((long long)rowCount * columnCount);
+        sweeps = sweeps > 0 ? sweeps : 1;
+    }
+    *flips = bandedSweeps(image, lattice, rowCount, columnCount, sweeps, threads, neighbourhood,
+                          seed ? *seed : (uint64_t)time(NULL), seed != NULL, 0, 0);
+
+    const char *name = fileName(input);
+    char output[strlen(outputDirectory) + strlen(name) + 2];
+    sprintf(output, "%s/%s", outputDirectory, name);
+    if (isPngPath(output))
+    {
+        // PNG images are written back as PNG
+        error = *flips < 0 || writePngImage(output, lattice, rowCount, columnCount);
+        arenaRelease(&memory);
+        return error;
+    }
+    if (isRlePath(output))
+    {
+        // and RLE images as RLE, compressed or not
+        error = *flips < 0 || writeRleImage(output, lattice, rowCount, columnCount);
+        arenaRelease(&memory);
+        return error;
+    }
+    if (isCompressedPath(output))
     {
-        for (columnNumber = 0; columnNumber < columnCount; ++columnNumber)
+        // compressed images are written back compressed, row after row
+        FILE *stream = *flips < 0 ? NULL : openImageStream(output, "w");
+        error = !stream;
+        for (row = 0; !error && row < rowCount; ++row)
+        {
+            formatTextPixels(lattice[row], columnCount, text);
+            text[3 * columnCount] = '\n';
+            error = fwrite(text, 1, 3 * (size_t)columnCount + 1, stream) != 3 * (size_t)columnCount + 1;
+        }
+        error |= stream && fclose(stream) != 0;
+        if (error)
         {
-            fprintf(outputFile, "%d ", (int)finalResult[rowNumber][columnNumber]);
+            fprintf(stderr, "Cannot write \"%s\"\n", output);
         }
-        fprintf(outputFile, "\n");
+        arenaRelease(&memory);
+        return error;
     }
-    printf("finished successfully!\n");
+    int outputFile = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (*flips < 0 || outputFile < 0)
+    {
+        fprintf(stderr, "Cannot write \"%s\"\n", output);
+        error = 1;
+    }
+    for (row = 0; !error && row < rowCount; ++row)
+    {
+        error = writeTextPiece(outputFile, lattice[row], row, 0, columnCount, columnCount, text);
+    }
+    if (outputFile >= 0)
+    {
+        close(outputFile);
+    }
+    arenaRelease(&memory);
+    return error;
+}
 
-    // printf("Running time for %d processors: %dus\n", world_size, papi_time_stop - papi_time_start);
-    return 0;
+/**
+ * Job farm worker: ask the master for images until it says stop, and denoise each of them locally with several
+ * threads.
+ * @param outputDirectory
+ * @param beta
+ * @param gammaValue
+ * @param sweeps per pixel, 0 for the TOTAL_ITERATIONS default
+ * @param threads
+ * @param seed NULL, or the seed of the deterministic sweeps
+ * @return 0
+ */
+int farmWorker(const char *outputDirectory, double beta, double gammaValue, int sweeps, int threads,
+               const uint64_t *seed)
+{
+    long long outcome[2] = {-1, 0};
+    char input[FARM_PATH_MAX];
+    fillThresholds(beta, gammaValue, neighbourhood->totalWeight);
+    while (1)
+    {
+        sendMessage(outcome, 2, MPI_LONG_LONG, MASTER_RANK, JOB_REQUEST);
+        receiveMessage(input, sizeof(input), MPI_CHAR, MASTER_RANK, JOB);
+        if (!input[0])
+        {
+            return 0;
+        }
+        outcome[0] = farmImage(input, outputDirectory, sweeps, threads, seed, outcome + 1);
+    }
+}
+
+/**
+ * Default number of threads of a job farm worker: the cores of its node shared by the workers on that node.
+ * @param workers communicator of the workers
+ * @return
+ */
+int farmThreads(MPI_Comm workers)
+{
+    MPI_Comm node;
+    int ranksOnNode;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    MPI_Comm_split_type(workers, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+    MPI_Comm_size(node, &ranksOnNode);
+    MPI_Comm_free(&node);
+    return cores / ranksOnNode > 0 ? (int)(cores / ranksOnNode) : 1;
 }
 
 /**
@@ -628,26 +1666,86 @@ int main(int argc, char **argv)
 {
 
     // MPI INITIALIZATIONS
-    MPI_Init(NULL, NULL);
+    /* the progress thread calls MPI concurrently with the compute loop */
+    int progressThread = optionFlag(argc, argv, 5, "--progress-thread"), provided;
+    MPI_Init_thread(&argc, &argv, progressThread ? MPI_THREAD_MULTIPLE : MPI_THREAD_SINGLE, &provided);
     int world_size;
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
     int world_rank;
     MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    /* the slaves agree on their termination among themselves, without the master */
+    MPI_Comm slaves;
+    MPI_Comm_split(MPI_COMM_WORLD, world_rank == MASTER_RANK ? MPI_UNDEFINED : 1, world_rank, &slaves);
 
     int error = 0;
     srand(time(NULL));
+    const char *knownOptions[] = {"row", "--neighborhood", "--progress-thread", "--batch", "--prefetch", "--sweeps", "--rebalance", "farm",
+                                  "--threads", "--shared-memory", "--seed", NULL};
+    neighbourhood = argc < 5 ? NULL : findStencil(optionValue(argc, argv, 5, "--neighborhood"));
+    if (optionValue(argc, argv, 5, "--batch"))
+    {
+        batchSize = atoi(optionValue(argc, argv, 5, "--batch"));
+    }
+    double sweeps = optionValue(argc, argv, 5, "--sweeps") ? atof(optionValue(argc, argv, 5, "--sweeps")) : 0;
+    int farm = optionFlag(argc, argv, 5, "farm");
+    /* the job farm runs whole sweeps of every image */
+    int wholeSweeps = sweeps >= 0 && sweeps == (int)sweeps;
+    int threads = optionValue(argc, argv, 5, "--threads") ? atoi(optionValue(argc, argv, 5, "--threads")) : 0;
+    /* with a seed the result does not depend on the decomposition */
+    uint64_t seed = optionValue(argc, argv, 5, "--seed") ? strtoull(optionValue(argc, argv, 5, "--seed"), NULL, 10) : 0;
+    const uint64_t *seedOption = optionValue(argc, argv, 5, "--seed") ? &seed : NULL;
 
     if (world_rank == MASTER_RANK)
     { // VALIDATIONS & RUN MASTER
         /* make arg checks in master to prevent duplicate error logs */
-        if (argc < 5 || argc > 6)
+        if (argc < 5 || !optionsValid(argc, argv, 5, knownOptions))
         {
             fprintf(stderr, "Please, run the program as \n"
-                            "\"denoiser <input> <output> <beta> <pi>\", or as \n"
-                            "\"denoiser <input> <output> <beta> <pi> row\n");
+                            "\"denoiser <input> <output> <beta> <pi> [options]\", or as \n"
+                            "\"denoiser <input> <output> <beta> <pi> row [options]\", or as \n"
+                            "\"denoiser <image_list> <output_directory> <beta> <pi> farm [--threads=<t>] "
+                            "[--sweeps=<n>] [--neighborhood=4|8|24] [--seed=<n>]\"\n"
+                            "options: --neighborhood=4|8 --progress-thread --batch=<pixels> --prefetch\n"
+                            "         --sweeps=<per pixel> --rebalance --shared-memory --seed=<n>\n");
+            return 1;
+        }
+        if (farm)
+        {
+            if (!neighbourhood || threads < 0 || world_size < 2)
+            {
+                fprintf(stderr, "The job farm needs a valid neighborhood, --threads and at least one worker\n");
+                return 1;
+            }
+            if (!wholeSweeps)
+            {
+                fprintf(stderr, "--sweeps must be a whole number of sweeps in the job farm\n");
+                return 1;
+            }
+            error = farmMaster(world_size, argv[1]);
+            MPI_Finalize();
+            return error;
+        }
+        if (batchSize < 1)
+        {
+            fprintf(stderr, "--batch must be at least 1\n");
             return 1;
         }
-        int grid = argc != 6 || strcmp(argv[5], "row") != 0;
+        if (optionValue(argc, argv, 5, "--sweeps") && sweeps <= 0)
+        {
+            fprintf(stderr, "--sweeps must be positive\n");
+            return 1;
+        }
+        if (progressThread && provided < MPI_THREAD_MULTIPLE)
+        {
+            fprintf(stderr, "--progress-thread needs an MPI library with MPI_THREAD_MULTIPLE support\n");
+            return 1;
+        }
+        if (!neighbourhood || neighbourhood->radius != 1)
+        {
+            fprintf(stderr, "Only the 4 and 8 neighborhoods are supported by the MPI version\n");
+            return 1;
+        }
+        int grid = !optionFlag(argc, argv, 5, "row");
         if (grid && sqrt(world_size - 1) * sqrt(world_size - 1) != world_size - 1)
         {
             fprintf(stderr, "When running in grid mode, the number of slaves "
@@ -663,17 +1761,41 @@ int main(int argc, char **argv)
     }
     else
     { // CALCULATE GAMMA AND RUN SLAVE
-        double beta = atof(argv[3]);
+        if (farm)
+        {
+            if (!neighbourhood || threads < 0 || !wholeSweeps)
+            {
+                return 1;
+            }
+            double pi = atof(argv[4]);
+            error = farmWorker(argv[2], atof(argv[3]) / neighbourhood->scale, log((1 - pi) / pi) / 2, (int)sweeps,
+                               threads ? threads : farmThreads(slaves), seedOption);
+            MPI_Comm_free(&slaves);
+            MPI_Finalize();
+            return error;
+        }
+        if (!neighbourhood || neighbourhood->radius != 1 || (progressThread && provided < MPI_THREAD_MULTIPLE) || batchSize < 1)
+        {
+            return 1;
+        }
+        double beta = atof(argv[3]) / neighbourhood->scale;
         double pi = atof(argv[4]);
         double gammaValue = log((1 - pi) / pi) / 2;
         // named gammaValue instead of gamma bc of the below warning:
         // warning: 'gamma' is deprecated: first deprecated in macOS 10.9 [-Wdeprecated-declarations]
-        if ((error = slave(world_size, world_rank, beta, gammaValue)))
+        if ((error = slave(world_rank, beta, gammaValue, progressThread,
+                             optionFlag(argc, argv, 5, "--prefetch"), slaves,
+                             sweeps, optionFlag(argc, argv, 5, "--rebalance"),
+                             optionFlag(argc, argv, 5, "--shared-memory") && !seedOption, seedOption)))
         {
             fprintf(stderr, "Error in slave");
             return error;
         };
     }
 
+    if (slaves != MPI_COMM_NULL)
+    {
+        MPI_Comm_free(&slaves);
+    }
     MPI_Finalize();
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -5,59 +6,137 @@
 #include <math.h>
 //#include <papi.h>
 #include <string.h>
-
+#include "options.c"
+#include "stencil.c"
+#include "rng.c"
+#include "fixedpoint.c"
+#include "affinity.c"
+#include "hugepage.c"
+#include "profile.c"
+#include "arena.c"
+#include "stream.c"
+#include "image_io.c"
+#include "rle.c"
+#include "sweep.c"
+
+#ifndef N
 #define N 10000
-#define THREADS 10
+#endif
 #define THREADSWORKER 10
-#define TOTAL_ITERATIONS 50000
+/* whole sweeps of the image: the old racy workers stopped after 50000 random updates per thread, far less than one */
+#define SWEEPS 5
+#define TILE_SIZE 64
 
 typedef struct fileinfo
 {
     char *file_name;
+    const textIndex *index;
     int start_index;
     int end_index;
     int id;
+    int cpu;
+    int failed; /* set by the reader if its rows could not be read */
 } fileinfo;
 
-typedef struct threadinfo
-{
-    int start_row;
-    int end_row;
-    int id;
-} threadinfo;
-
-int matrix[N][N];
-int finalmatrix[N][N];
+char (*matrix)[N];
+char (*finalmatrix)[N];
+char *matrixRows[N], *finalmatrixRows[N];
 double beta, gammaValue;
 
 void *thread(void *);
-int gotospecificline(FILE *, int);
-void matrixcopy(void *destmat, void *srcmat);
-void *worker(void *);
 
 int main(int argc, char **argv)
 {
     // long_long papi_time_start, papi_time_stop;
     // papi_time_start = PAPI_get_real_usec();
     int i, j;
+    const char *knownOptions[] = {"--threads", "--sweeps", "--neighborhood", "--schedule", "--tile", "--pin",
+                                  "--huge-pages", "--profile", "--seed", NULL};
+    if (argc < 5 || !optionsValid(argc, argv, 5, knownOptions))
+    {
+        fprintf(stderr, "Please, run the program as \n"
+                        "\"denoiser <input> <output> <beta> <pi> [--threads=<n>] [--sweeps=<n>] [--neighborhood=4|8|24] "
+                        "[--schedule=static|stealing] [--tile=<size>] [--pin] [--huge-pages=off|transparent|explicit] "
+                        "[--profile] [--seed=<n>]\"\n");
+        return EXIT_FAILURE;
+    }
+    const stencil *neighbourhood = findStencil(optionValue(argc, argv, 5, "--neighborhood"));
+    char *threadsOption = optionValue(argc, argv, 5, "--threads");
+    char *sweepsOption = optionValue(argc, argv, 5, "--sweeps");
+    int threadsworker = threadsOption ? atoi(threadsOption) : THREADSWORKER;
+    int sweeps = sweepsOption ? atoi(sweepsOption) : SWEEPS;
+    char *scheduleOption = optionValue(argc, argv, 5, "--schedule");
+    char *tileOption = optionValue(argc, argv, 5, "--tile");
+    int stealing = scheduleOption && strcmp(scheduleOption, "stealing") == 0;
+    int tileSize = stealing ? (tileOption ? atoi(tileOption) : TILE_SIZE) : 0;
+    if (!neighbourhood || threadsworker < 1 || threadsworker > N || sweeps < 0 || (stealing && tileSize < 1) ||
+        (scheduleOption && !stealing && strcmp(scheduleOption, "static") != 0))
+    {
+        fprintf(stderr, "--threads must be between 1 and %d, --sweeps must not be negative, --schedule must be "
+                        "static or stealing and --tile must be positive\n", N);
+        return EXIT_FAILURE;
+    }
+    if (!setPageMode(optionValue(argc, argv, 5, "--huge-pages")))
+    {
+        return EXIT_FAILURE;
+    }
+    int profiling = optionFlag(argc, argv, 5, "--profile");
+    /* with a seed the result does not depend on the threads nor on the schedule */
+    char *seedOption = optionValue(argc, argv, 5, "--seed");
+    uint64_t seed = seedOption ? strtoull(seedOption, NULL, 10) : (uint64_t)time(NULL);
     char *file_name = argv[1];
     char *file_name_output = argv[2];
-    beta = atof(argv[3]);
+    beta = atof(argv[3]) / neighbourhood->scale;
     double pi = atof(argv[4]);
     gammaValue = log((1 - pi) / pi) / 2;
 
-    pthread_t threads[THREADS];
+    /* not touched here: the pages are placed by the threads that first write them */
+    arena memory = {NULL};
+    matrix = (char(*)[N])arenaAlloc(&memory, (size_t)N * N);
+    finalmatrix = (char(*)[N])arenaAlloc(&memory, (size_t)N * N);
+    if (!matrix || !finalmatrix)
+    {
+        fprintf(stderr, "Not enough memory for a %d x %d image\n", N, N);
+        return EXIT_FAILURE;
+    }
+
+    /* the readers jump straight to their rows with the index of the image, built (and saved) on the first run;
+       an RLE image has its size in its header, and no index */
+    textIndex index = {0, 0, 0, NULL};
+    int runLength = isRlePath(file_name);
+    if (runLength ? rleImageSize(file_name, &index.rows, &index.columns) : loadTextIndex(file_name, &index))
+    {
+        return EXIT_FAILURE;
+    }
+    if (index.rows != N || index.columns != N)
+    {
+        fprintf(stderr, "The image is %d x %d, it must be %d x %d\n", index.rows, index.columns, N, N);
+        return EXIT_FAILURE;
+    }
+
+    int pin = optionFlag(argc, argv, 5, "--pin");
+    int cpus[CPU_SETSIZE];
+    int cpuCount = pin ? numaOrderedCpus(cpus, CPU_SETSIZE) : 0;
+
+    pthread_t threads[threadsworker];
+    fileinfo finfos[threadsworker];
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
-    for (i = 0; i < THREADS; i++)
+    /* one reader per worker band, on the same core, so that the image rows are first touched on the node of their worker;
+       a compressed or RLE image can only be read from the start, by a single reader */
+    int readers = isCompressedPath(file_name) || runLength ? 1 : threadsworker;
+    for (i = 0; i < readers; i++)
     {
-        fileinfo *finfo = (fileinfo *)malloc(sizeof(fileinfo));
+        fileinfo *finfo = finfos + i;
         finfo->file_name = file_name;
-        finfo->start_index = i * (N / THREADS);
-        finfo->end_index = finfo->start_index + (N / THREADS) - 1;
+        finfo->index = &index;
+        finfo->start_index = (int)((long long)i * N / readers);
+        finfo->end_index = (int)((long long)(i + 1) * N / readers) - 1;
         finfo->id = i;
+        finfo->cpu = cpuCount ? bandCpu(i, threadsworker, cpus, cpuCount) : -1;
+        finfo->failed = 0;
 
         if (pthread_create(&threads[i], NULL, thread, (void *)finfo) != 0)
         {
@@ -66,34 +145,64 @@ int main(int argc, char **argv)
         }
     }
 
-    for (i = 0; i < THREADS; i++)
+    int readFailed = 0;
+    for (i = 0; i < readers; i++)
     {
         pthread_join(threads[i], NULL);
+        readFailed |= finfos[i].failed;
+    }
+    freeTextIndex(&index);
+    if (readFailed)
+    {
+        fprintf(stderr, "Cannot read the image \"%s\"\n", file_name);
+        return EXIT_FAILURE;
     }
 
-    matrixcopy(finalmatrix, matrix);
+    for (i = 0; i < N; i++)
+    {
+        matrixRows[i] = matrix[i];
+        finalmatrixRows[i] = finalmatrix[i];
+    }
 
-    pthread_t threadsworker[THREADSWORKER];
+    fillThresholds(beta, gammaValue, neighbourhood->totalWeight);
+    profile sampling;
+    struct timespec start, stop;
+    if (profiling)
+    {
+        profileStart(&sampling);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long flips = bandedSweeps(matrixRows, finalmatrixRows, N, N, sweeps, threadsworker, neighbourhood, seed,
+                                   seedOption != NULL, tileSize, pin);
+    if (flips < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (profiling)
+    {
+        profileStop(&sampling, "sampling");
+    }
+    double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    // parsed by scripts/scaling.py
+    printf("Sampling time with %d threads: %.3fs (%.1f Mupdates/s, %lld flips)\n", threadsworker, seconds,
+           seconds > 0 ? (double)sweeps * N * N / seconds / 1e6 : 0.0, flips);
 
-    for (i = 0; i < THREADSWORKER; i++)
+    if (isRlePath(file_name_output))
     {
-        threadinfo *tinfo = (threadinfo *)malloc(sizeof(threadinfo));
-        tinfo->start_row = i * (N / THREADSWORKER);
-        tinfo->end_row = tinfo->start_row + (N / THREADSWORKER) - 1;
-        tinfo->id = i;
-        if (pthread_create(&threadsworker[i], NULL, worker, (void *)tinfo) != 0)
+        if (writeRleImage(file_name_output, finalmatrixRows, N, N))
         {
-            printf("pthread_create failed!\n");
             return EXIT_FAILURE;
         }
+        arenaRelease(&memory);
+        pthread_exit(NULL);
     }
-
-    for (i = 0; i < THREADSWORKER; i++)
+    FILE *file = openImageStream(file_name_output, "w");
+    if (!file)
     {
-        pthread_join(threadsworker[i], NULL);
+        fprintf(stderr, "Cannot open the output file \"%s\"\n", file_name_output);
+        return EXIT_FAILURE;
     }
-
-    FILE *file = fopen(file_name_output, "w");
     for (i = 0; i < N; i++)
     {
         for (j = 0; j < N; j++)
@@ -110,132 +219,72 @@ int main(int argc, char **argv)
         fprintf(file, "\n");
     }
     fclose(file);
+    arenaRelease(&memory);
     // papi_time_stop = PAPI_get_real_usec();
     // printf("Running time: %dus\n", papi_time_stop - papi_time_start);
 
     pthread_exit(NULL);
 }
 
-int gotospecificline(FILE *file, int nextLine)
-{
-    int i;
-    char *line = NULL;
-    size_t len = 0;
-    for (i = 0; i < nextLine; i++)
-    {
-        getline(&line, &len, file);
-    }
-    return 0;
-}
-
 void *thread(void *args)
 {
-    int i, j;
+    int i;
     char *line = NULL;
-    ssize_t c;
     fileinfo *finfo = (fileinfo *)args;
 
-    FILE *file = fopen(finfo->file_name, "r");
-
-    size_t length = 0;
-
-    if (c = gotospecificline(file, finfo->start_index) != 0)
+    if (finfo->cpu >= 0)
     {
-        printf("Error fseek");
+        pinThread(finfo->cpu);
     }
-
-    for (i = finfo->start_index; i <= finfo->end_index; i++)
+    FILE *file = openImageStream(finfo->file_name, "r");
+    if (!file)
     {
-        getline(&line, &length, file);
-        char *tmp = NULL;
-
-        for (j = 0; j < N; j++)
-        {
-            char val[3];
-            val[0] = line[(j * 3)];
-            val[1] = line[(j * 3) + 1];
-            val[2] = line[(j * 3) + 2];
-
-            int x = atoi(val);
-            matrix[i][j] = x;
-        }
+        fprintf(stderr, "Cannot open the input file \"%s\"\n", finfo->file_name);
+        finfo->failed = 1;
+        return NULL;
     }
 
-    fclose(file);
-}
-
-void matrixcopy(void *destmat, void *srcmat)
-{
-    memcpy(destmat, srcmat, N * N * sizeof(int));
-}
-
-int getrandom(int lower, int upper)
-{
-    return (rand() % (upper - lower + 1)) + lower;
-}
-
-int adder(int rows, int columns, int rowCenter, int columnCenter)
-{
-    int sum = 0;
-    int i, j;
-    for (i = rowCenter - 1; i <= rowCenter + 1; ++i)
+    if (isRlePath(finfo->file_name))
     {
-        if (i >= 0 && i < rows)
-        { // if within row boundaries
-            for (j = columnCenter - 1; j <= columnCenter + 1; ++j)
+        // single reader, the image is N x N
+        int rows, columns;
+        unsigned char *buffer = (unsigned char *)malloc(RLE_ROW_BOUND(N));
+        if (!buffer || readRleHeader(file, &rows, &columns))
+        {
+            fprintf(stderr, "Cannot read \"%s\"\n", finfo->file_name);
+            finfo->failed = 1;
+        }
+        for (i = 0; !finfo->failed && i < N; i++)
+        {
+            if (readRleRow(file, buffer, matrix[i], N))
             {
-                if (j >= 0 && j < columns)
-                { // if within column boundaries
-                    if (i != rowCenter || j != columnCenter)
-                    { // skip center
-                        sum += finalmatrix[i][j];
-                    }
-                }
+                fprintf(stderr, "Cannot read row %d\n", i);
+                finfo->failed = 1;
             }
         }
+        free(buffer);
+        fclose(file);
+        return NULL;
     }
-    return sum;
-};
 
-double randomProbability()
-{
-    return ((double)rand()) / RAND_MAX;
-}
+    size_t length = 0;
 
-void *worker(void *arg)
-{
-    int count = 0;
-    srand(time(NULL));
-    threadinfo *tinfo = (threadinfo *)arg;
-    int iterations = TOTAL_ITERATIONS;
-    while (iterations--)
+    if (seekTextRow(file, finfo->index, finfo->start_index, &line, &length) != 0)
     {
-        if (iterations % 1000000 == 0)
-        {
-            // printf("thread %d started a new millionth iteration (iterations left: %d)\n", tinfo->id, iterations);
-        }
-        /* pick a random pixel */
-        int rowPosition = getrandom(tinfo->start_row, tinfo->end_row);
-        int columnPosition = rand() % N;
-        int rowCount = tinfo->end_row - tinfo->start_row + 1;
-
-        /* sum neighbour cells */
-        int sum = adder(N, N, rowPosition, columnPosition);
-
-        /* calculate delta_e */
-        double deltaE = -2 * gammaValue * matrix[rowPosition][columnPosition] * finalmatrix[rowPosition][columnPosition] - 2 * beta * finalmatrix[rowPosition][columnPosition] * sum;
-
-        if (iterations == 3000002)
-        {
-            //printf("Thread id: %d ha delta pari a %d, e ha log(randomProbability):%d\n", tinfo->id, deltaE, log(randomProbability()));
-        }
+        fprintf(stderr, "Cannot seek to row %d\n", finfo->start_index);
+        finfo->failed = 1;
+    }
 
-        if (log(randomProbability()) <= deltaE)
+    for (i = finfo->start_index; !finfo->failed && i <= finfo->end_index; i++)
+    {
+        if (readTextRow(file, &line, &length, matrix[i], N) <= 0)
         {
-            // flip the pixel
-            //count ++;
-            finalmatrix[rowPosition][columnPosition] = -finalmatrix[rowPosition][columnPosition];
+            fprintf(stderr, "Cannot read row %d\n", i);
+            finfo->failed = 1;
         }
     }
-    //printf("Thread id: %d ha fatto %d flip\n", tinfo->id, count);
+
+    free(line);
+    fclose(file);
+    return NULL;
 }
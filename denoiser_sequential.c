@@ -1,12 +1,32 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
 //#include <papi.h>
-#include "queue.c"
+#include "options.c"
+#include "stencil.c"
+#include "rng.c"
+#include "fixedpoint.c"
+#include "affinity.c"
+#include "sweep.c"
+#include "hugepage.c"
+#include "profile.c"
+#include "arena.c"
+#include "stream.c"
+#include "image_io.c"
+#include "rle.c"
+#include "png_io.c"
 
 #define TOTAL_ITERATIONS 5000000
+#define DEFAULT_THRESHOLD 0.001
+#define DEFAULT_TILE_SIZE 64
+#define DEFAULT_TIME_BLOCK 4
+#define CACHE_BYTES (1 << 20)
+
+/* the neighbourhood selected with --neighborhood */
+const stencil *neighbourhood;
 
 /**
  * generates a random number between 0 and 1.0 (both inclusive)
@@ -18,7 +38,8 @@ double randomProbability()
 }
 
 /**
- * Sum the surroundings of a point in a grid. (Ignores out of boundaries by not considering them in the sum)
+ * Sum the surroundings of a point in a grid with the selected neighbourhood stencil.
+ * (Ignores out of boundaries by not considering them in the sum)
  * Also does not include the center point in the sum.
  * @param subImage
  * @param rows
@@ -29,145 +50,712 @@ double randomProbability()
  */
 int summer(char **subImage, int rows, int columns, int rowCenter, int columnCenter)
 {
-    int sum = 0;
-    int i, j;
-    for (i = rowCenter - 1; i <= rowCenter + 1; ++i)
+    return stencilSumOf(neighbourhood, subImage, rows, columns, rowCenter, columnCenter);
+};
+
+/**
+ * The plain Metropolis-Hastings sampler: pick a pixel uniformly at random and flip it with the usual acceptance test.
+ * @param image the noisy input image
+ * @param finalResult the lattice being denoised, updated in place
+ * @param rowCount
+ * @param columnCount
+ * @param beta
+ * @param gammaValue
+ * @param iterations number of proposals
+ */
+void metropolis(char **image, char **finalResult, int rowCount, int columnCount,
+                double beta, double gammaValue, int iterations)
+{
+    while (iterations--)
+    {
+        if (iterations % 1000000 == 0)
+        {
+            printf("Iteration left: %d\n", iterations);
+        }
+        /* pick a random pixel */
+        int rowPosition = rand() % rowCount;
+        int columnPosition = rand() % columnCount;
+
+        /* sum neighbour cells */
+        int sum = summer(finalResult, rowCount, columnCount, rowPosition, columnPosition);
+
+        /* calculate delta_e */
+        // double deltaE = - 2 * finalResult[rowPosition][columnPosition] * (gammaValue * image[rowPosition][columnPosition] + beta * sum);
+        double deltaE = -2 * gammaValue * image[rowPosition][columnPosition] * finalResult[rowPosition][columnPosition] - 2 * beta * finalResult[rowPosition][columnPosition] * sum;
+        // printf("delta: %f exp delta %f\n", deltaE, exp(deltaE));
+        // deltaE = log(accept_probability)  *** accept_probability can be bigger than 1, since we skipped Min(1, acc_prob) ***
+        if (log(randomProbability()) <= deltaE)
+        {
+            // if accepted, flip the pixel
+            finalResult[rowPosition][columnPosition] = -finalResult[rowPosition][columnPosition];
+        }
+    }
+}
+
+/**
+ * Integer-only version of the plain sampler: pixels are picked and the acceptance test is done with the raw 32 bit
+ * output of an integer generator against the quantized thresholds, so there is no floating point in the loop.
+ * @param image
+ * @param finalResult
+ * @param rowCount
+ * @param columnCount
+ * @param iterations number of proposals
+ * @param seed
+ */
+void fixedPointMetropolis(char **image, char **finalResult, int rowCount, int columnCount, int iterations,
+                          uint64_t seed)
+{
+    rng generator;
+    seedRandom(&generator, seed);
+    while (iterations--)
     {
-        if (i >= 0 && i < rows)
-        { // if within row boundaries
-            for (j = columnCenter - 1; j <= columnCenter + 1; ++j)
+        if (iterations % 1000000 == 0)
+        {
+            printf("Iteration left: %d\n", iterations);
+        }
+        int rowPosition = nextBounded(&generator, rowCount);
+        int columnPosition = nextBounded(&generator, columnCount);
+        int sum = summer(finalResult, rowCount, columnCount, rowPosition, columnPosition);
+        char *pixel = finalResult[rowPosition] + columnPosition;
+        if (nextRandom(&generator) <= thresholds[image[rowPosition][columnPosition] > 0][*pixel > 0][sum + MAX_STENCIL_WEIGHT])
+        {
+            *pixel = -*pixel;
+        }
+    }
+}
+
+/**
+ * Book-keeping of the active-set sampler.
+ * sites is a permutation of all pixel indices (row * columns + column): the first activeCount entries are the
+ * "frontier" pixels whose acceptance probability is above the threshold, the rest is the settled background.
+ * position is the inverse permutation, sums caches the neighbour sum of every pixel.
+ */
+typedef struct activeSet
+{
+    int *sites;
+    int *position;
+    signed char *sums;
+    int activeCount;
+    int size;
+} activeSet;
+
+/**
+ * Acceptance probability min(1, exp(deltaE)) for every (image pixel, current pixel, neighbour sum) combination,
+ * indexed as acceptance[image > 0][current > 0][sum + MAX_STENCIL_WEIGHT].
+ */
+double acceptance[2][2][2 * MAX_STENCIL_WEIGHT + 1];
+
+void fillAcceptance(double beta, double gammaValue)
+{
+    int imagePixel, pixel, sum;
+    for (imagePixel = -1; imagePixel <= 1; imagePixel += 2)
+    {
+        for (pixel = -1; pixel <= 1; pixel += 2)
+        {
+            for (sum = -neighbourhood->totalWeight; sum <= neighbourhood->totalWeight; ++sum)
             {
-                if (j >= 0 && j < columns)
-                { // if within column boundaries
-                    if (i != rowCenter || j != columnCenter)
-                    { // skip center
-                        sum += (int)subImage[i][j];
-                    }
-                }
+                double deltaE = -2 * gammaValue * imagePixel * pixel - 2 * beta * pixel * sum;
+                acceptance[imagePixel > 0][pixel > 0][sum + MAX_STENCIL_WEIGHT] = deltaE >= 0 ? 1.0 : exp(deltaE);
             }
         }
     }
-    return sum;
-};
+}
 
-int main(int argc, char **argv)
+/**
+ * Move a pixel to the frontier or to the background depending on its current acceptance probability.
+ * @param set
+ * @param image
+ * @param finalResult
+ * @param columnCount
+ * @param site
+ * @param threshold
+ */
+void classify(activeSet *set, char **image, char **finalResult, int columnCount, int site, double threshold)
 {
+    int row = site / columnCount, column = site % columnCount;
+    int active = acceptance[image[row][column] > 0][finalResult[row][column] > 0][set->sums[site] + MAX_STENCIL_WEIGHT] > threshold;
+    int index = set->position[site];
+    int target;
+    if (active == (index < set->activeCount))
+    {
+        return;
+    }
+    if (active)
+    {
+        target = set->activeCount++;
+    }
+    else
+    {
+        target = --set->activeCount;
+    }
+    // swap the pixel with the one sitting on the border between the two regions
+    int other = set->sites[target];
+    set->sites[target] = site;
+    set->sites[index] = other;
+    set->position[site] = target;
+    set->position[other] = index;
+}
 
-    srand(time(NULL));
+/**
+ * Flip a pixel and incrementally update the cached sums and the classification of the pixel and its neighbours.
+ */
+void flipActive(activeSet *set, char **image, char **finalResult, int rowCount, int columnCount,
+                int rowCenter, int columnCenter, double threshold)
+{
+    int k;
+    int change = -2 * finalResult[rowCenter][columnCenter];
+    finalResult[rowCenter][columnCenter] = -finalResult[rowCenter][columnCenter];
+    classify(set, image, finalResult, columnCount, rowCenter * columnCount + columnCenter, threshold);
+    // stencils are symmetric, so the pixels having the flipped one in their neighbourhood are its own neighbours
+    for (k = 0; k < neighbourhood->count; ++k)
+    {
+        int i = rowCenter + neighbourhood->offsets[k][0];
+        int j = columnCenter + neighbourhood->offsets[k][1];
+        if (i >= 0 && i < rowCount && j >= 0 && j < columnCount)
+        {
+            set->sums[i * columnCount + j] += change * neighbourhood->offsets[k][2];
+            classify(set, image, finalResult, columnCount, i * columnCount + j, threshold);
+        }
+    }
+}
 
-    if (argc != 5)
+/**
+ * Active-set sampler: proposals are concentrated on the frontier pixels, i.e. the ones whose acceptance probability
+ * is above threshold. Settled pixels in uniform regions (most of a document page) are not visited one by one.
+ *
+ * With exact == 0 only frontier pixels are proposed, which is fast but biased.
+ * With exact == 1 the uniform proposal of the plain sampler is reproduced exactly: every proposal is a frontier pixel
+ * with probability activeCount / size, otherwise a background pixel, whose acceptance probability is known to be at
+ * most threshold. A background proposal is thinned into a "candidate" with probability threshold and then accepted with
+ * probability acceptance / threshold, so the runs of non-candidate proposals (which cannot change anything) are skipped
+ * in one geometric draw while still being counted against the iteration budget.
+ * @param image
+ * @param finalResult
+ * @param rowCount
+ * @param columnCount
+ * @param beta
+ * @param gammaValue
+ * @param iterations number of proposals of the equivalent plain sampler
+ * @param threshold
+ * @param exact
+ * @return 0 on success, 1 if there is not enough memory (an error is printed)
+ */
+int activeSetSampler(char **image, char **finalResult, int rowCount, int columnCount, double beta,
+                      double gammaValue, int iterations, double threshold, int exact)
+{
+    activeSet set;
+    int row, column, site;
+    set.size = rowCount * columnCount;
+    set.sites = (int *)hugeAlloc(set.size * sizeof(int));
+    set.position = (int *)hugeAlloc(set.size * sizeof(int));
+    set.sums = (signed char *)hugeAlloc(set.size * sizeof(signed char));
+    if (!set.sites || !set.position || !set.sums)
     {
-        fprintf(stderr, "Please, run the program as \n"
-                        "\"sequential <input> <output> <beta> <pi>\"");
+        fprintf(stderr, "Not enough memory for the active set of %d pixels\n", set.size);
+        hugeFree(set.sites, set.size * sizeof(int));
+        hugeFree(set.position, set.size * sizeof(int));
+        hugeFree(set.sums, set.size * sizeof(signed char));
         return 1;
     }
+    set.activeCount = 0;
+    fillAcceptance(beta, gammaValue);
+    for (site = 0; site < set.size; ++site)
+    {
+        set.sites[site] = site;
+        set.position[site] = site;
+        set.sums[site] = summer(finalResult, rowCount, columnCount, site / columnCount, site % columnCount);
+    }
+    for (site = 0; site < set.size; ++site)
+    {
+        classify(&set, image, finalResult, columnCount, site, threshold);
+    }
+    printf("active set: %d of %d pixels on the frontier\n", set.activeCount, set.size);
 
-    // long_long papi_time_start, papi_time_stop;
-    // papi_time_start = PAPI_get_real_usec();
+    long long left = iterations;
+    while (left > 0)
+    {
+        int background = set.size - set.activeCount;
+        double rate = exact ? set.activeCount + background * threshold : set.activeCount;
+        if (rate <= 0)
+        {
+            // nothing can flip any more
+            break;
+        }
+        if (exact && rate < set.size)
+        {
+            /* skip the proposals that are neither frontier pixels nor background candidates */
+            double u = (rand() + 1.0) / ((double)RAND_MAX + 1.0);
+            left -= (long long)(log(u) / log1p(-rate / set.size));
+            if (left <= 0)
+            {
+                break;
+            }
+        }
+        --left;
 
-    double beta = atof(argv[3]);
-    double pi = atof(argv[4]);
-    double gammaValue = log((1 - pi) / pi) / 2;
-    char *input = argv[1];
-    char *output = argv[2];
+        double probability;
+        /* drawn from [0, 1), so that with no background pixel the frontier is always chosen */
+        if (!exact || rand() / ((double)RAND_MAX + 1.0) * rate < set.activeCount)
+        {
+            site = set.sites[rand() % set.activeCount];
+            probability = 1.0;
+        }
+        else
+        {
+            site = set.sites[set.activeCount + rand() % background];
+            probability = threshold;
+        }
+        row = site / columnCount;
+        column = site % columnCount;
+        double deltaE = -2 * gammaValue * image[row][column] * finalResult[row][column] - 2 * beta * finalResult[row][column] * set.sums[site];
+        if (log(randomProbability() * probability) <= deltaE)
+        {
+            flipActive(&set, image, finalResult, rowCount, columnCount, row, column, threshold);
+        }
+    }
+    printf("active set: %d of %d pixels on the frontier at the end\n", set.activeCount, set.size);
+    hugeFree(set.sites, set.size * sizeof(int));
+    hugeFree(set.position, set.size * sizeof(int));
+    hugeFree(set.sums, set.size * sizeof(signed char));
+    return 0;
+}
 
-    // region START
+/**
+ * Metropolis update of a single pixel, used by the systematic sweep engines.
+ * With a key the update is the fixed point one of the threaded engines, with the random number of pixelRandom(), so
+ * that the result for a seed is the same as theirs.
+ * @param neighbourSum the neighbour sum of the stencil, a constant in the copies of the engines made for every stencil
+ * @return 1 if the pixel was flipped, 0 otherwise
+ */
+static inline __attribute__((always_inline)) int
+updatePixel(stencilSum neighbourSum, char **image, char **finalResult, int rowCount, int columnCount, int row,
+            int column, double beta, double gammaValue, const pixelKey *key)
+{
+    int sum = neighbourSum(finalResult, rowCount, columnCount, row, column);
+    if (key)
+    {
+        char *pixel = finalResult[row] + column;
+        if (pixelRandom(key, row, column) <= thresholds[image[row][column] > 0][*pixel > 0][sum + MAX_STENCIL_WEIGHT])
+        {
+            *pixel = -*pixel;
+            return 1;
+        }
+        return 0;
+    }
+    double deltaE = -2 * gammaValue * image[row][column] * finalResult[row][column] - 2 * beta * finalResult[row][column] * sum;
+    if (log(randomProbability()) <= deltaE)
+    {
+        finalResult[row][column] = -finalResult[row][column];
+        return 1;
+    }
+    return 0;
+}
 
-    FILE *inputFile, *outputFile;
-    inputFile = fopen(input, "r");
+/**
+ * Tile bookkeeping of the sweep engine: flips of the current sweep, number of consecutive sweeps without any flip,
+ * and whether the tile is dormant (skipped).
+ */
+typedef struct tileState
+{
+    int flips;
+    int quietSweeps;
+    int dormant;
+} tileState;
 
-    queue *rowQueue = newQueue();
-    int rowCount = 0;
-    int columnCount = 0;
+/**
+ * Wake up the tiles around a flipped pixel whose pixels have it in their neighbourhood.
+ */
+void wakeNeighbourTiles(tileState *tiles, int tileColumns, int tileSize, int rowCount, int columnCount, int row,
+                        int column)
+{
+    int i, j;
+    int ownTile = (row / tileSize) * tileColumns + column / tileSize;
+    for (i = row - neighbourhood->radius; i <= row + neighbourhood->radius; ++i)
+    {
+        if (i >= 0 && i < rowCount)
+        {
+            for (j = column - neighbourhood->radius; j <= column + neighbourhood->radius; ++j)
+            {
+                if (j >= 0 && j < columnCount)
+                {
+                    int tile = (i / tileSize) * tileColumns + j / tileSize;
+                    if (tile != ownTile)
+                    {
+                        tiles[tile].dormant = 0;
+                        tiles[tile].quietSweeps = 0;
+                    }
+                }
+            }
+        }
+    }
+}
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
+/**
+ * Systematic sweep engine. Every sweep visits the pixels in colour phases, tile by tile. The colours are a
+ * (radius + 1) x (radius + 1) checkerboard, 2x2 for the 3x3 neighbourhoods, so that no two pixels of the same colour
+ * are neighbours.
+ * A tile with no flips for dormantAfter consecutive sweeps goes dormant and is skipped, until a flip on the border of a
+ * neighbouring tile wakes it up. dormantAfter == 0 disables dormancy.
+ * @param neighbourSum
+ * @param image
+ * @param finalResult
+ * @param rowCount
+ * @param columnCount
+ * @param beta
+ * @param gammaValue
+ * @param sweeps
+ * @param tileSize
+ * @param dormantAfter
+ * @param seed NULL, or the seed of the deterministic fixed point updates
+ */
+static inline __attribute__((always_inline)) void
+sweepSamplerWith(stencilSum neighbourSum, char **image, char **finalResult, int rowCount, int columnCount, double beta,
+                 double gammaValue, int sweeps, int tileSize, int dormantAfter, const uint64_t *seed)
+{
+    int tileRows = (rowCount + tileSize - 1) / tileSize;
+    int tileColumns = (columnCount + tileSize - 1) / tileSize;
+    int tileCount = tileRows * tileColumns;
+    tileState *tiles = (tileState *)calloc(tileCount, sizeof(tileState));
+    long long visitedTiles = 0, skippedTiles = 0;
+    int sweep, color, tile, row, column;
+    int radius = neighbourhood->radius, side = radius + 1;
 
-    while ((read = getline(&line, &len, inputFile)) != -1)
+    for (sweep = 0; sweep < sweeps; ++sweep)
     {
-        int i, cursor = 0, nextCursor, nextPixel;
-        char *row = NULL;
-        if (columnCount == 0)
+        pixelKey key = {seed ? *seed : 0, (uint64_t)sweep, 0, 0};
+        for (tile = 0; tile < tileCount; ++tile)
+        {
+            tiles[tile].flips = 0;
+        }
+        for (color = 0; color < side * side; ++color)
         {
-            queue *columnQueue = newQueue();
-            while (sscanf(line + cursor, "%d%n", &nextPixel, &nextCursor) > 0)
+            for (tile = 0; tile < tileCount; ++tile)
             {
-                cursor += nextCursor;
-                ++columnCount;
-                push(columnQueue, (void *)nextPixel);
+                if (tiles[tile].dormant)
+                {
+                    ++skippedTiles;
+                    continue;
+                }
+                ++visitedTiles;
+                int rowStart = (tile / tileColumns) * tileSize;
+                int rowEnd = rowStart + tileSize < rowCount ? rowStart + tileSize : rowCount;
+                int columnStart = (tile % tileColumns) * tileSize;
+                int columnEnd = columnStart + tileSize < columnCount ? columnStart + tileSize : columnCount;
+                for (row = firstOfColor(rowStart, color / side, side); row < rowEnd; row += side)
+                {
+                    for (column = firstOfColor(columnStart, color % side, side); column < columnEnd; column += side)
+                    {
+                        if (updatePixel(neighbourSum, image, finalResult, rowCount, columnCount, row, column, beta,
+                                        gammaValue, seed ? &key : NULL))
+                        {
+                            ++tiles[tile].flips;
+                            if (dormantAfter && (row < rowStart + radius || row >= rowEnd - radius ||
+                                                 column < columnStart + radius || column >= columnEnd - radius))
+                            {
+                                wakeNeighbourTiles(tiles, tileColumns, tileSize, rowCount, columnCount, row, column);
+                            }
+                        }
+                    }
+                }
             }
-            row = (char *)malloc(columnCount * sizeof(char));
-            for (i = 0; i < columnCount; ++i)
+        }
+        if (dormantAfter)
+        {
+            for (tile = 0; tile < tileCount; ++tile)
             {
-                row[i] = (char)pop(columnQueue);
+                if (tiles[tile].dormant)
+                {
+                    continue;
+                }
+                tiles[tile].quietSweeps = tiles[tile].flips ? 0 : tiles[tile].quietSweeps + 1;
+                tiles[tile].dormant = tiles[tile].quietSweeps >= dormantAfter;
             }
-            freeQueue(columnQueue);
         }
-        else
+    }
+    printf("sweep engine: %d sweeps, %lld tile phases visited, %lld skipped as dormant\n",
+           sweeps, visitedTiles, skippedTiles);
+    free(tiles);
+}
+
+#define SWEEP_SAMPLER_CASE(name, NEIGHBOURHOOD, radius)                                                         \
+    case name##Kind:                                                                                           \
+        sweepSamplerWith(name##Sum, image, finalResult, rowCount, columnCount, beta, gammaValue, sweeps,       \
+                         tileSize, dormantAfter, seed);                                                        \
+        break;
+
+/**
+ * Run the copy of the sweep engine made for the selected stencil, see sweepSamplerWith().
+ */
+void sweepSampler(char **image, char **finalResult, int rowCount, int columnCount, double beta, double gammaValue,
+                  int sweeps, int tileSize, int dormantAfter, const uint64_t *seed)
+{
+    switch (neighbourhood->kind)
+    {
+        STENCILS(SWEEP_SAMPLER_CASE)
+    default:
+        sweepSamplerWith(neighbourhood->sum, image, finalResult, rowCount, columnCount, beta, gammaValue, sweeps,
+                         tileSize, dormantAfter, seed);
+    }
+}
+
+/**
+ * Temporally blocked version of the sweep engine for lattices that do not fit in the cache.
+ * Instead of streaming the whole lattice through memory once per colour phase, the rows are split in bands of
+ * bandRows rows and every band runs all the colour phases of timeBlock sweeps before moving on.
+ * Phase k of band b covers rows [b * bandRows - k * radius, (b + 1) * bandRows - k * radius): the band slides up by
+ * the stencil radius every phase, so that the rows just above it have already been brought to phase k by the previous
+ * band (and not further), and the rows just below it are still at phase k - 1. Every pixel therefore sees exactly the
+ * neighbour values it would see in the plain phase-by-phase sweep, and the working set is only
+ * bandRows + phases * radius rows.
+ * @param neighbourSum
+ * @param image
+ * @param finalResult
+ * @param rowCount
+ * @param columnCount
+ * @param beta
+ * @param gammaValue
+ * @param sweeps
+ * @param bandRows
+ * @param timeBlock number of sweeps run on a band before moving to the next one
+ * @param seed NULL, or the seed of the deterministic fixed point updates
+ */
+static inline __attribute__((always_inline)) void
+temporalSweepSamplerWith(stencilSum neighbourSum, char **image, char **finalResult, int rowCount, int columnCount,
+                         double beta, double gammaValue, int sweeps, int bandRows, int timeBlock, const uint64_t *seed)
+{
+    int first, band, phase, row, column;
+    int radius = neighbourhood->radius, side = radius + 1;
+    for (first = 0; first < sweeps; first += timeBlock)
+    {
+        int phases = side * side * (sweeps - first < timeBlock ? sweeps - first : timeBlock);
+        int bands = (rowCount + (phases - 1) * radius - 1) / bandRows + 1;
+        for (band = 0; band < bands; ++band)
         {
-            row = (char *)malloc(columnCount * sizeof(char));
-            i = 0;
-            while (sscanf(line + cursor, "%d%n", &nextPixel, &nextCursor) > 0)
+            for (phase = 0; phase < phases; ++phase)
             {
-                cursor += nextCursor;
-                row[i++] = (char)nextPixel;
+                int color = phase % (side * side);
+                int skew = phase * radius;
+                int rowStart = band * bandRows - skew > 0 ? band * bandRows - skew : 0;
+                int rowEnd = (band + 1) * bandRows - skew < rowCount ? (band + 1) * bandRows - skew : rowCount;
+                pixelKey key = {seed ? *seed : 0, (uint64_t)(first + phase / (side * side)), 0, 0};
+                for (row = firstOfColor(rowStart, color / side, side); row < rowEnd; row += side)
+                {
+                    for (column = color % side; column < columnCount; column += side)
+                    {
+                        updatePixel(neighbourSum, image, finalResult, rowCount, columnCount, row, column, beta,
+                                    gammaValue, seed ? &key : NULL);
+                    }
+                }
             }
         }
-        ++rowCount;
-        push(rowQueue, (void *)row);
     }
+    printf("temporal sweep engine: %d sweeps, bands of %d rows, %d sweeps per band visit\n",
+           sweeps, bandRows, timeBlock);
+}
+
+#define TEMPORAL_SWEEP_SAMPLER_CASE(name, NEIGHBOURHOOD, radius)                                                \
+    case name##Kind:                                                                                           \
+        temporalSweepSamplerWith(name##Sum, image, finalResult, rowCount, columnCount, beta, gammaValue, sweeps, \
+                                 bandRows, timeBlock, seed);                                                   \
+        break;
+
+/**
+ * Run the copy of the temporally blocked engine made for the selected stencil, see temporalSweepSamplerWith().
+ */
+void temporalSweepSampler(char **image, char **finalResult, int rowCount, int columnCount, double beta,
+                          double gammaValue, int sweeps, int bandRows, int timeBlock, const uint64_t *seed)
+{
+    switch (neighbourhood->kind)
+    {
+        STENCILS(TEMPORAL_SWEEP_SAMPLER_CASE)
+    default:
+        temporalSweepSamplerWith(neighbourhood->sum, image, finalResult, rowCount, columnCount, beta, gammaValue,
+                                 sweeps, bandRows, timeBlock, seed);
+    }
+}
+
+int main(int argc, char **argv)
+{
+
+    srand(time(NULL));
 
-    char *finalResult[rowCount], *image[rowCount];
+    const char *knownOptions[] = {"--engine", "--threshold", "--sweeps", "--tile", "--dormant-after", "--band",
+                                  "--time-block", "--neighborhood", "--huge-pages", "--profile", "--seed", NULL};
+    const char *engines[] = {"metropolis", "fixed", "active", "active-exact", "sweep", "temporal", NULL};
+    if (argc < 5 || !optionsValid(argc, argv, 5, knownOptions))
+    {
+        fprintf(stderr, "Please, run the program as \n"
+                        "\"sequential <input> <output> <beta> <pi> [--engine=metropolis|fixed|active|active-exact|sweep|temporal] "
+                        "[--threshold=<t>] [--sweeps=<n>] [--tile=<size>] [--dormant-after=<k>] [--band=<rows>] "
+                        "[--time-block=<sweeps>] [--neighborhood=4|8|24] [--huge-pages=off|transparent|explicit] "
+                        "[--profile] [--seed=<n>]\"");
+        return 1;
+    }
+    char *engine = optionValue(argc, argv, 5, "--engine");
+    engine = engine ? engine : "metropolis";
     int i;
-    for (i = 0; i < rowCount; i++)
+    for (i = 0; engines[i] && strcmp(engine, engines[i]) != 0; ++i)
+        ;
+    if (!engines[i])
+    {
+        fprintf(stderr, "Unknown engine \"%s\"\n", engine);
+        return 1;
+    }
+    char *thresholdOption = optionValue(argc, argv, 5, "--threshold");
+    double threshold = thresholdOption ? atof(thresholdOption) : DEFAULT_THRESHOLD;
+    if (threshold <= 0 || threshold >= 1)
+    {
+        fprintf(stderr, "The threshold must be between 0 and 1 (exclusive)\n");
+        return 1;
+    }
+    char *sweepsOption = optionValue(argc, argv, 5, "--sweeps");
+    char *tileOption = optionValue(argc, argv, 5, "--tile");
+    char *dormantOption = optionValue(argc, argv, 5, "--dormant-after");
+    int tileSize = tileOption ? atoi(tileOption) : DEFAULT_TILE_SIZE;
+    int dormantAfter = dormantOption ? atoi(dormantOption) : 0;
+    char *bandOption = optionValue(argc, argv, 5, "--band");
+    char *timeBlockOption = optionValue(argc, argv, 5, "--time-block");
+    int bandRows = bandOption ? atoi(bandOption) : 0;
+    int timeBlock = timeBlockOption ? atoi(timeBlockOption) : DEFAULT_TIME_BLOCK;
+    if (tileSize < 2 || dormantAfter < 0 || bandRows < 0 || timeBlock < 1)
+    {
+        fprintf(stderr, "The tile size must be at least 2, --band, --dormant-after must not be negative "
+                        "and --time-block must be positive\n");
+        return 1;
+    }
+    if (!(neighbourhood = findStencil(optionValue(argc, argv, 5, "--neighborhood"))) ||
+        !setPageMode(optionValue(argc, argv, 5, "--huge-pages")))
+    {
+        return 1;
+    }
+    int profiling = optionFlag(argc, argv, 5, "--profile");
+    char *seedOption = optionValue(argc, argv, 5, "--seed");
+    uint64_t seed = seedOption ? strtoull(seedOption, NULL, 10) : 0;
+    if (seedOption && strcmp(engine, "sweep") != 0 && strcmp(engine, "temporal") != 0)
     {
-        image[i] = (char *)pop(rowQueue);
-        finalResult[i] = (char *)malloc(columnCount * sizeof(char));
-        memcpy(finalResult[i], image[i], columnCount);
+        fprintf(stderr, "--seed needs the sweep or the temporal engine\n");
+        return 1;
     }
 
-    // region Calculations
-    int iterations = TOTAL_ITERATIONS;
+    // long_long papi_time_start, papi_time_stop;
+    // papi_time_start = PAPI_get_real_usec();
 
-    while (iterations--)
+    double beta = atof(argv[3]) / neighbourhood->scale;
+    double pi = atof(argv[4]);
+    double gammaValue = log((1 - pi) / pi) / 2;
+    if (seedOption)
     {
-        if (iterations % 1000000 == 0)
-        {
-            printf("Iteration left: %d\n", iterations);
-        }
-        /* pick a random pixel */
-        int rowPosition = rand() % rowCount;
-        int columnPosition = rand() % columnCount;
+        fillThresholds(beta, gammaValue, neighbourhood->totalWeight);
+    }
+    char *input = argv[1];
+    char *output = argv[2];
 
-        /* sum neighbour cells */
-        int sum = summer(finalResult, rowCount, columnCount, rowPosition, columnPosition);
+    // region START
 
-        /* calculate delta_e */
-        // double deltaE = - 2 * finalResult[rowPosition][columnPosition] * (gammaValue * image[rowPosition][columnPosition] + beta * sum);
-        double deltaE = -2 * gammaValue * image[rowPosition][columnPosition] * finalResult[rowPosition][columnPosition] - 2 * beta * finalResult[rowPosition][columnPosition] * sum;
-        // printf("delta: %f exp delta %f\n", deltaE, exp(deltaE));
-        // deltaE = log(accept_probability)  *** accept_probability can be bigger than 1, since we skipped Min(1, acc_prob) ***
-        if (log(randomProbability()) <= deltaE)
+    FILE *outputFile;
+    int rowCount, columnCount;
+
+    /* all the image buffers come from one arena, released at the end in one call */
+    arena memory = {NULL};
+    char *imageData = readImage(&memory, input, &rowCount, &columnCount);
+    if (!imageData)
+    {
+        return 1;
+    }
+    char *latticeData = (char *)arenaAlloc(&memory, (size_t)rowCount * columnCount);
+    char **image = rowPointers(&memory, imageData, rowCount, columnCount);
+    char **finalResult = latticeData ? rowPointers(&memory, latticeData, rowCount, columnCount) : NULL;
+    if (!image || !finalResult)
+    {
+        fprintf(stderr, "Not enough memory for a %d x %d image\n", rowCount, columnCount);
+        return 1;
+    }
+    memcpy(latticeData, imageData, (size_t)rowCount * columnCount);
+
+    // region Calculations
+    profile calculations;
+    if (profiling)
+    {
+        profileStart(&calculations);
+    }
+    if (strcmp(engine, "metropolis") == 0)
+    {
+        metropolis(image, finalResult, rowCount, columnCount, beta, gammaValue, TOTAL_ITERATIONS);
+    }
+    else if (strcmp(engine, "fixed") == 0)
+    {
+        fillThresholds(beta, gammaValue, neighbourhood->totalWeight);
+        fixedPointMetropolis(image, finalResult, rowCount, columnCount, TOTAL_ITERATIONS, time(NULL));
+    }
+    else if (strcmp(engine, "sweep") == 0)
+    {
+        // by default the same number of pixel updates as the random engines, at least one sweep
+        int sweeps = sweepsOption ? atoi(sweepsOption) : TOTAL_ITERATIONS / (rowCount * columnCount);
+        sweepSampler(image, finalResult, rowCount, columnCount, beta, gammaValue, sweeps > 0 ? sweeps : 1,
+                     tileSize, dormantAfter, seedOption ? &seed : NULL);
+    }
+    else if (strcmp(engine, "temporal") == 0)
+    {
+        int sweeps = sweepsOption ? atoi(sweepsOption) : TOTAL_ITERATIONS / (rowCount * columnCount);
+        if (bandRows == 0)
         {
-            // if accepted, flip the pixel
-            finalResult[rowPosition][columnPosition] = -finalResult[rowPosition][columnPosition];
+            // image and lattice rows of a band and of its skew must stay in the cache
+            bandRows = CACHE_BYTES / (2 * columnCount) - neighbourhood->radius * (neighbourhood->radius + 1) *
+                                                                (neighbourhood->radius + 1) * timeBlock;
+            bandRows = bandRows > 16 ? bandRows : 16;
+        }
+        temporalSweepSampler(image, finalResult, rowCount, columnCount, beta, gammaValue, sweeps > 0 ? sweeps : 1,
+                             bandRows, timeBlock, seedOption ? &seed : NULL);
+    }
+    else
+    {
+        if (activeSetSampler(image, finalResult, rowCount, columnCount, beta, gammaValue, TOTAL_ITERATIONS,
+                             threshold, strcmp(engine, "active-exact") == 0))
+        {
+            return 1;
         }
     }
     // endregion
 
+    if (profiling)
+    {
+        profileStop(&calculations, engine);
+    }
     printf("finished calculations, started writing to output\n");
 
     int rowNumber, columnNumber;
-    outputFile = fopen(output, "w");
-    for (rowNumber = 0; rowNumber < rowCount; ++rowNumber)
+    if (isPngPath(output))
+    {
+        if (writePngImage(output, finalResult, rowCount, columnCount))
+        {
+            return 1;
+        }
+    }
+    else if (isRlePath(output))
     {
-        for (columnNumber = 0; columnNumber < columnCount; ++columnNumber)
+        if (writeRleImage(output, finalResult, rowCount, columnCount))
         {
-            fprintf(outputFile, "%d ", (int)finalResult[rowNumber][columnNumber]);
+            return 1;
+        }
+    }
+    else
+    {
+        if (!(outputFile = openImageStream(output, "w")))
+        {
+            fprintf(stderr, "Cannot open the output file \"%s\"\n", output);
+            return 1;
+        }
+        for (rowNumber = 0; rowNumber < rowCount; ++rowNumber)
+        {
+            for (columnNumber = 0; columnNumber < columnCount; ++columnNumber)
+            {
+                fprintf(outputFile, "%d ", (int)finalResult[rowNumber][columnNumber]);
+            }
+            fprintf(outputFile, "\n");
         }
-        fprintf(outputFile, "\n");
+        fclose(outputFile);
     }
+    arenaRelease(&memory);
     // papi_time_stop = PAPI_get_real_usec();
     // printf("Running time %dus\n", papi_time_stop - papi_time_start);
     printf("finished successfully!\n");
@@ -0,0 +1,35 @@
+#include <stdint.h>
+#include <math.h>
+
+/**
+ * Acceptance thresholds quantized to 32 bits, so that the acceptance test is a single integer comparison against the
+ * raw output of nextRandom(): a flip is accepted when random <= threshold, i.e. with probability
+ * (threshold + 1) / 2^32, which is min(1, exp(deltaE)) rounded to 2^-32.
+ * Indexed as thresholds[image > 0][current > 0][sum + MAX_STENCIL_WEIGHT].
+ */
+uint32_t thresholds[2][2][2 * MAX_STENCIL_WEIGHT + 1];
+
+/**
+ * Quantize the acceptance probabilities of every (image pixel, current pixel, neighbour sum) combination.
+ * This is the only place where floating point is used by the fixed point engines.
+ * @param beta already divided by the stencil scale
+ * @param gammaValue
+ * @param totalWeight largest absolute neighbour sum of the stencil
+ */
+void fillThresholds(double beta, double gammaValue, int totalWeight)
+{
+    int imagePixel, pixel, sum;
+    for (imagePixel = -1; imagePixel <= 1; imagePixel += 2)
+    {
+        for (pixel = -1; pixel <= 1; pixel += 2)
+        {
+            for (sum = -totalWeight; sum <= totalWeight; ++sum)
+            {
+                double deltaE = -2 * gammaValue * imagePixel * pixel - 2 * beta * pixel * sum;
+                double probability = exp(deltaE);
+                thresholds[imagePixel > 0][pixel > 0][sum + MAX_STENCIL_WEIGHT] =
+                    probability >= 1 ? UINT32_MAX : (uint32_t)(probability * 4294967296.0);
+            }
+        }
+    }
+}
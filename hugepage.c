@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+/**
+ * How the big buffers (lattices, sum caches) are backed:
+ * PAGES_NORMAL with plain malloc, PAGES_TRANSPARENT with anonymous memory advised for transparent huge pages,
+ * PAGES_EXPLICIT with pages from the hugetlbfs pool (MAP_HUGETLB), falling back to transparent huge pages when the pool
+ * is empty or not configured.
+ */
+enum PageMode
+{
+    PAGES_NORMAL = 0,
+    PAGES_TRANSPARENT = 1,
+    PAGES_EXPLICIT = 2
+};
+
+int pageMode = PAGES_NORMAL;
+
+/**
+ * Parse the value of a --huge-pages=off|transparent|explicit option into pageMode.
+ * @param value NULL keeps the default
+ * @return 1 if the value is valid, 0 otherwise (an error is printed)
+ */
+int setPageMode(const char *value)
+{
+    if (!value || strcmp(value, "off") == 0)
+    {
+        pageMode = PAGES_NORMAL;
+    }
+    else if (strcmp(value, "transparent") == 0)
+    {
+        pageMode = PAGES_TRANSPARENT;
+    }
+    else if (strcmp(value, "explicit") == 0)
+    {
+        pageMode = PAGES_EXPLICIT;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown huge page mode \"%s\", use off, transparent or explicit\n", value);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Allocate a big buffer according to pageMode, rounded up to whole huge pages when huge pages are used.
+ * @param size
+ * @return the buffer, to be released with hugeFree(buffer, size), or NULL
+ */
+void *hugeAlloc(size_t size)
+{
+    void *buffer;
+    size_t rounded = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    if (pageMode == PAGES_NORMAL)
+    {
+        return malloc(size);
+    }
+#ifdef MAP_HUGETLB
+    if (pageMode == PAGES_EXPLICIT)
+    {
+        buffer = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buffer != MAP_FAILED)
+        {
+            return buffer;
+        }
+        static int warned = 0;
+        if (!warned)
+        {
+            printf("no explicit huge pages available for %zu bytes, using transparent huge pages\n", rounded);
+            warned = 1;
+        }
+    }
+#endif
+    buffer = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(buffer, rounded, MADV_HUGEPAGE);
+#endif
+    return buffer;
+}
+
+/**
+ * Release a buffer allocated with hugeAlloc (with the same pageMode).
+ * @param buffer
+ * @param size the size given to hugeAlloc
+ */
+void hugeFree(void *buffer, size_t size)
+{
+    if (!buffer)
+    {
+        return;
+    }
+    if (pageMode == PAGES_NORMAL)
+    {
+        free(buffer);
+        return;
+    }
+    munmap(buffer, (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+}
@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Vectorized parsing of the rows: PARSE_CHUNK characters are classified at a time, and the pixels are found from
+ * bit masks of the '1' and '-' characters (one bit per character). Any character other than whitespace, '-' and '1',
+ * or a token other than 1 and -1, makes the row go through the scalar parser instead.
+ * Compile with -mavx2 -mbmi2 (or -march=native) for 32 characters at a time, SSE2 (any x86-64) does 16.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PARSE_CHUNK 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PARSE_CHUNK 16
+#endif
+
+#ifdef PARSE_CHUNK
+/* one bit per character of a chunk */
+typedef uint32_t parseMask;
+#define CHUNK_BITS ((parseMask)((1ULL << PARSE_CHUNK) - 1))
+
+/**
+ * Classify PARSE_CHUNK characters.
+ * @param text
+ * @param ones set to the mask of the '1' characters
+ * @param minus set to the mask of the '-' characters
+ * @return 1 if all the characters are whitespace, '1' or '-'
+ */
+int classifyChunk(const char *text, parseMask *ones, parseMask *minus)
+{
+#if defined(__AVX2__)
+    __m256i characters = _mm256_loadu_si256((const __m256i *)text);
+    __m256i one = _mm256_cmpeq_epi8(characters, _mm256_set1_epi8('1'));
+    __m256i sign = _mm256_cmpeq_epi8(characters, _mm256_set1_epi8('-'));
+    __m256i space = _mm256_cmpeq_epi8(characters, _mm256_set1_epi8(' '));
+    // '\t' to '\r': below 5 once shifted by '\t'
+    __m256i control = _mm256_sub_epi8(characters, _mm256_set1_epi8('\t'));
+    control = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8(4)), control);
+    __m256i allowed = _mm256_or_si256(_mm256_or_si256(one, sign), _mm256_or_si256(space, control));
+    *ones = (parseMask)_mm256_movemask_epi8(one);
+    *minus = (parseMask)_mm256_movemask_epi8(sign);
+    return (parseMask)_mm256_movemask_epi8(allowed) == CHUNK_BITS;
+#else
+    __m128i characters = _mm_loadu_si128((const __m128i *)text);
+    __m128i one = _mm_cmpeq_epi8(characters, _mm_set1_epi8('1'));
+    __m128i sign = _mm_cmpeq_epi8(characters, _mm_set1_epi8('-'));
+    __m128i space = _mm_cmpeq_epi8(characters, _mm_set1_epi8(' '));
+    __m128i control = _mm_sub_epi8(characters, _mm_set1_epi8('\t'));
+    control = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(4)), control);
+    __m128i allowed = _mm_or_si128(_mm_or_si128(one, sign), _mm_or_si128(space, control));
+    *ones = (parseMask)_mm_movemask_epi8(one);
+    *minus = (parseMask)_mm_movemask_epi8(sign);
+    return (parseMask)_mm_movemask_epi8(allowed) == CHUNK_BITS;
+#endif
+}
+
+/**
+ * Write the pixels of a chunk: one per bit of ones, -1 where the bit is also set in negatives.
+ * Only the pixels are written, never more than room bytes.
+ * @param ones
+ * @param negatives
+ * @param row
+ * @param room number of pixels that still fit in the row
+ * @return the number of pixels written
+ */
+int emitChunk(parseMask ones, parseMask negatives, char *row, int room)
+{
+    int count = __builtin_popcount(ones);
+    count = count < room ? count : room;
+#if defined(__AVX2__) && defined(__BMI2__)
+    // gather the signs of the pixels in the low bits, and spread them over 32 bytes: -1 where set, 1 otherwise
+    __m256i signs = _mm256_set1_epi32((int)_pext_u32(negatives, ones));
+    __m256i bytes = _mm256_shuffle_epi8(signs, _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                                                2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3));
+    __m256i bits = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+    __m256i pixels = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_and_si256(bytes, bits), bits), _mm256_set1_epi8(1));
+    // a chunk holds at most PARSE_CHUNK / 2 pixels (two 1 are never adjacent): the low lane, stored whole when it is
+    // full, and only the pixels otherwise
+    __m128i low = _mm256_castsi256_si128(pixels);
+    if (count == PARSE_CHUNK / 2)
+    {
+        _mm_storeu_si128((__m128i *)row, low);
+    }
+    else
+    {
+        char produced[PARSE_CHUNK / 2];
+        _mm_storeu_si128((__m128i *)produced, low);
+        memcpy(row, produced, count);
+    }
+    return count;
+#else
+    int i = 0;
+    for (; ones && i < room; ones &= ones - 1)
+    {
+        row[i++] = negatives >> __builtin_ctz(ones) & 1 ? -1 : 1;
+    }
+    return count;
+#endif
+}
+
+/**
+ * Vectorized parseTextRow() for the rows made of 1 and -1 only, whatever the whitespace between them.
+ * @param line
+ * @param row
+ * @param columns
+ * @return the number of pixels read, or -1 if the row has to go through the scalar parser
+ */
+int parseTextRowVector(const char *line, char *row, int columns)
+{
+    size_t length = strlen(line), offset;
+    parseMask lastMinus = 0, lastOne = 0;
+    int count = 0;
+    for (offset = 0; offset < length && count < columns; offset += PARSE_CHUNK)
+    {
+        const char *text = line + offset;
+        char tail[PARSE_CHUNK];
+        if (length - offset < PARSE_CHUNK)
+        {
+            // the end of the line, padded with spaces
+            memset(tail, ' ', PARSE_CHUNK);
+            memcpy(tail, text, length - offset);
+            text = tail;
+        }
+        parseMask ones, minus;
+        if (!classifyChunk(text, &ones, &minus))
+        {
+            return -1;
+        }
+        // the character before every one, carried over from the previous chunk for the first one
+        parseMask signs = ((minus << 1) | lastMinus) & CHUNK_BITS;
+        parseMask afterOne = ((ones << 1) | lastOne) & CHUNK_BITS;
+        if ((signs & ~ones) || (ones & afterOne))
+        {
+            // a '-' not followed by '1', or a number like 11
+            return -1;
+        }
+        lastMinus = minus >> (PARSE_CHUNK - 1);
+        lastOne = ones >> (PARSE_CHUNK - 1);
+        count += emitChunk(ones, signs, row + count, columns - count);
+    }
+    if (lastOne && offset < length && line[offset] >= '0' && line[offset] <= '9')
+    {
+        // stopped at the last column, in the middle of a number like 11
+        return -1;
+    }
+    return count;
+}
+#endif
+
+/**
+ * Parse one line of a text image (1 and -1 separated by spaces).
+ * @param line
+ * @param row receives the pixels
+ * @param columns maximum number of pixels to read
+ * @return the number of pixels read
+ */
+int parseTextRow(const char *line, char *row, int columns)
+{
+#ifdef PARSE_CHUNK
+    int count = parseTextRowVector(line, row, columns);
+    if (count >= 0)
+    {
+        return count;
+    }
+#endif
+    int i = 0, cursor = 0, nextCursor, nextPixel;
+    while (i < columns && sscanf(line + cursor, "%d%n", &nextPixel, &nextCursor) > 0)
+    {
+        cursor += nextCursor;
+        row[i++] = (char)nextPixel;
+    }
+    return i;
+}
+
+/**
+ * Read the next non empty row of a text image.
+ * @param inputFile
+ * @param line getline() buffer, to be freed by the caller
+ * @param len
+ * @param row receives the pixels
+ * @param columns number of pixels expected
+ * @return 1 if a full row was read, 0 at the end of the file, -1 if the row is too short (an error is printed)
+ */
+int readTextRow(FILE *inputFile, char **line, size_t *len, char *row, int columns)
+{
+    int count;
+    do
+    {
+        if (getline(line, len, inputFile) == -1)
+        {
+            return 0;
+        }
+        count = parseTextRow(*line, row, columns);
+    } while (count == 0);
+    if (count < columns)
+    {
+        fprintf(stderr, "A row has %d pixels instead of %d\n", count, columns);
+        return -1;
+    }
+    return 1;
+}
+
+/* rows between two offsets of a text image index */
+#define TEXT_INDEX_STRIDE 1024
+
+/**
+ * Index of a text image, kept next to it in "<image>.idx" so that a re-run on the same input does not have to scan it:
+ * the size of the image and the byte offset of every stride-th row (rows are the non empty lines). The size and the
+ * modification time of the image are stored with it, a stale index is rebuilt. scripts/build_index.py writes the same
+ * file.
+ * Format (text): "image-index 1", then "<rows> <columns> <stride> <file size> <modification time in ns>", then one
+ * offset per line.
+ */
+typedef struct textIndex
+{
+    int rows;
+    int columns;
+    int stride;
+    long long *offsets;
+} textIndex;
+
+/**
+ * Size and modification time that an index of the image must match.
+ */
+int textIndexStamp(const char *path, long long *size, long long *modified)
+{
+    struct stat info;
+    if (stat(path, &info) != 0)
+    {
+        return 1;
+    }
+    *size = (long long)info.st_size;
+    *modified = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+    return 0;
+}
+
+/**
+ * Read the index of an image, if there is an up to date one.
+ * @param path of the image
+ * @param index
+ * @return 0 on success
+ */
+int readTextIndex(const char *path, textIndex *index)
+{
+    char indexPath[strlen(path) + 5];
+    long long size, modified, indexSize, indexModified;
+    int version, i, count;
+    sprintf(indexPath, "%s.idx", path);
+    FILE *indexFile = fopen(indexPath, "r");
+    if (!indexFile)
+    {
+        return 1;
+    }
+    index->offsets = NULL;
+    if (textIndexStamp(path, &size, &modified) != 0 || fscanf(indexFile, "image-index %d", &version) != 1 ||
+        version != 1 ||
+        fscanf(indexFile, "%d %d %d %lld %lld", &index->rows, &index->columns, &index->stride, &indexSize,
+               &indexModified) != 5 ||
+        indexSize != size || indexModified != modified || index->rows <= 0 || index->stride <= 0)
+    {
+        fclose(indexFile);
+        return 1;
+    }
+    count = (index->rows - 1) / index->stride + 1;
+    index->offsets = (long long *)malloc(count * sizeof(long long));
+    for (i = 0; index->offsets && i < count && fscanf(indexFile, "%lld", index->offsets + i) == 1; ++i)
+        ;
+    fclose(indexFile);
+    if (i < count)
+    {
+        free(index->offsets);
+        index->offsets = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Scan an image to index it, and save the index next to it (silently skipped if that is not possible).
+ * @param path of the image
+ * @param index
+ * @return 0 on success, 1 otherwise (an error is printed)
+ */
+int buildTextIndex(const char *path, textIndex *index)
+{
+    FILE *inputFile = openImageStream(path, "r");
+    char *line = NULL;
+    size_t len = 0, capacity = 64;
+    ssize_t read;
+    long long offset = 0, size, modified;
+    if (!inputFile)
+    {
+        fprintf(stderr, "Cannot open the input file \"%s\"\n", path);
+        return 1;
+    }
+    index->rows = 0;
+    index->columns = 0;
+    index->stride = TEXT_INDEX_STRIDE;
+    index->offsets = (long long *)malloc(capacity * sizeof(long long));
+    while (index->offsets && (read = getline(&line, &len, inputFile)) != -1)
+    {
+        int nonEmpty;
+        if (index->columns == 0)
+        {
+            // at most one pixel every two characters, and the last one
+            int room = (int)(read / 2 + 1);
+            char *row = (char *)malloc(room);
+            index->columns = row ? parseTextRow(line, row, room) : 0;
+            free(row);
+            nonEmpty = index->columns > 0;
+        }
+        else
+        {
+            nonEmpty = strspn(line, " \t\r\n") < (size_t)read;
+        }
+        if (nonEmpty && index->rows % index->stride == 0)
+        {
+            if ((size_t)(index->rows / index->stride) == capacity)
+            {
+                capacity *= 2;
+                long long *offsets = (long long *)realloc(index->offsets, capacity * sizeof(long long));
+                if (!offsets)
+                {
+                    free(index->offsets);
+                    index->offsets = NULL;
+                    break;
+                }
+                index->offsets = offsets;
+            }
+            index->offsets[index->rows / index->stride] = offset;
+        }
+        index->rows += nonEmpty;
+        offset += read;
+    }
+    free(line);
+    fclose(inputFile);
+    if (!index->offsets)
+    {
+        fprintf(stderr, "Not enough memory to index \"%s\"\n", path);
+        return 1;
+    }
+    if (index->rows == 0)
+    {
+        fprintf(stderr, "The input file \"%s\" is empty\n", path);
+        free(index->offsets);
+        index->offsets = NULL;
+        return 1;
+    }
+
+    char indexPath[strlen(path) + 5];
+    sprintf(indexPath, "%s.idx", path);
+    FILE *indexFile = textIndexStamp(path, &size, &modified) == 0 ? fopen(indexPath, "w") : NULL;
+    if (indexFile)
+    {
+        int i;
+        fprintf(indexFile, "image-index 1\n%d %d %d %lld %lld\n", index->rows, index->columns, index->stride, size,
+                modified);
+        for (i = 0; i <= (index->rows - 1) / index->stride; ++i)
+        {
+            fprintf(indexFile, "%lld\n", index->offsets[i]);
+        }
+        fclose(indexFile);
+    }
+    return 0;
+}
+
+/**
+ * Index of an image: read from its up to date index file, or built (and saved) on first read.
+ * @param path
+ * @param index to be released with freeTextIndex()
+ * @return 0 on success, 1 otherwise (an error is printed)
+ */
+int loadTextIndex(const char *path, textIndex *index)
+{
+    return readTextIndex(path, index) == 0 ? 0 : buildTextIndex(path, index);
+}
+
+void freeTextIndex(textIndex *index)
+{
+    free(index->offsets);
+    index->offsets = NULL;
+}
+
+/**
+ * Position a file on a row of the image: jump to the closest indexed row before it, and skip the rows in between.
+ * The rows before the first indexed row after the start are only skipped, which also works for the (not seekable)
+ * compressed streams.
+ * @param inputFile just opened
+ * @param index
+ * @param row
+ * @param line getline() buffer, to be freed by the caller
+ * @param len
+ * @return 0 on success
+ */
+int seekTextRow(FILE *inputFile, const textIndex *index, int row, char **line, size_t *len)
+{
+    int skip = row % index->stride;
+    if (row < 0 || row >= index->rows ||
+        (row >= index->stride && fseeko(inputFile, (off_t)index->offsets[row / index->stride], SEEK_SET) != 0))
+    {
+        return 1;
+    }
+    while (skip > 0)
+    {
+        ssize_t read = getline(line, len, inputFile);
+        if (read == -1)
+        {
+            return 1;
+        }
+        skip -= strspn(*line, " \t\r\n") < (size_t)read;
+    }
+    return 0;
+}
+
+/**
+ * Read a text image (1 and -1 separated by spaces, one row per line) into a single contiguous, row-strided buffer.
+ * Every pixel takes at least two characters in the file, so half of the file size bounds the image size: the buffer
+ * is allocated once from the arena with that size and the pixels are parsed straight into it. The size of a
+ * compressed image comes from its index instead (see textIndex).
+ * @param memory
+ * @param path
+ * @param rowCount set to the number of rows
+ * @param columnCount set to the number of columns (of the first row)
+ * @return the pixels, row after row, or NULL (an error is printed)
+ */
+char *readTextImage(arena *memory, const char *path, int *rowCount, int *columnCount)
+{
+    struct stat info;
+    textIndex index;
+    size_t bound;
+    if (isCompressedPath(path))
+    {
+        if (loadTextIndex(path, &index))
+        {
+            return NULL;
+        }
+        bound = (size_t)index.rows * index.columns;
+        freeTextIndex(&index);
+    }
+    else
+    {
+        bound = stat(path, &info) == 0 ? (size_t)info.st_size / 2 + 1 : 0;
+    }
+    FILE *inputFile = openImageStream(path, "r");
+    if (!inputFile || bound == 0)
+    {
+        fprintf(stderr, "Cannot open the input file \"%s\"\n", path);
+        if (inputFile)
+        {
+            fclose(inputFile);
+        }
+        return NULL;
+    }
+    char *pixels = (char *)arenaAlloc(memory, bound);
+    if (!pixels)
+    {
+        fprintf(stderr, "Not enough memory to read \"%s\"\n", path);
+        fclose(inputFile);
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t len = 0;
+    int result = 0;
+    *rowCount = 0;
+    *columnCount = 0;
+
+    while (getline(&line, &len, inputFile) != -1)
+    {
+        *columnCount = parseTextRow(line, pixels, bound < INT_MAX ? (int)bound : INT_MAX);
+        if (*columnCount > 0)
+        {
+            ++*rowCount;
+            break;
+        }
+    }
+    while (*columnCount > 0 &&
+           (result = readTextRow(inputFile, &line, &len, pixels + (size_t)*rowCount * *columnCount, *columnCount)) > 0)
+    {
+        ++*rowCount;
+    }
+    free(line);
+    fclose(inputFile);
+    if (result < 0)
+    {
+        return NULL;
+    }
+    if (*rowCount == 0)
+    {
+        fprintf(stderr, "The input file \"%s\" is empty\n", path);
+        return NULL;
+    }
+    return pixels;
+}
+/**
+ * Get the size of a text image without keeping it in memory: the columns of the first row and the number of non
+ * empty lines. They come from the index of the image (see textIndex), which is built if there is none yet.
+ * @param path
+ * @param rowCount
+ * @param columnCount
+ * @return 0 on success, 1 otherwise (an error is printed)
+ */
+int textImageSize(const char *path, int *rowCount, int *columnCount)
+{
+    textIndex index;
+    if (loadTextIndex(path, &index))
+    {
+        return 1;
+    }
+    *rowCount = index.rows;
+    *columnCount = index.columns;
+    freeTextIndex(&index);
+    return 0;
+}
+
+/**
+ * Format pixels as fixed width text, "  1" or " -1" per pixel (the format of scripts/image_to_text.py).
+ * With a fixed width every pixel of the output file has a known offset, so pieces of rows can be written in any order.
+ * @param pixels
+ * @param count
+ * @param text receives 3 * count characters
+ */
+void formatTextPixels(const char *pixels, int count, char *text)
+{
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        text[3 * i] = ' ';
+        text[3 * i + 1] = pixels[i] < 0 ? '-' : ' ';
+        text[3 * i + 2] = '1';
+    }
+}
+
+/**
+ * Write a piece of a row of a fixed width text image at its place in the output file.
+ * @param outputFile
+ * @param pixels
+ * @param row
+ * @param column first column of the piece
+ * @param count number of pixels of the piece
+ * @param columnCount pixels per row of the image
+ * @param text buffer of at least 3 * count + 1 characters
+ * @return 0 on success
+ */
+int writeTextPiece(int outputFile, const char *pixels, int row, int column, int count, int columnCount, char *text)
+{
+    size_t size = 3 * (size_t)count;
+    formatTextPixels(pixels, count, text);
+    if (column + count == columnCount)
+    {
+        text[size++] = '\n';
+    }
+    off_t offset = (off_t)row * (3 * (off_t)columnCount + 1) + 3 * (off_t)column;
+    return pwrite(outputFile, text, size, offset) == (ssize_t)size ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Look for an optional "--name=value" argument after the positional arguments.
+ * @param argc
+ * @param argv
+ * @param first index of the first optional argument
+ * @param name option name including the leading dashes, e.g. "--engine"
+ * @return the value part of the option, or NULL if it was not given
+ */
+char *optionValue(int argc, char **argv, int first, const char *name)
+{
+    size_t length = strlen(name);
+    int i;
+    for (i = first; i < argc; ++i)
+    {
+        if (strncmp(argv[i], name, length) == 0 && argv[i][length] == '=')
+        {
+            return argv[i] + length + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check whether a bare "--name" flag was given after the positional arguments.
+ * @param argc
+ * @param argv
+ * @param first index of the first optional argument
+ * @param name flag name including the leading dashes
+ * @return 1 if the flag is present, 0 otherwise
+ */
+int optionFlag(int argc, char **argv, int first, const char *name)
+{
+    int i;
+    for (i = first; i < argc; ++i)
+    {
+        if (strcmp(argv[i], name) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Make sure every optional argument is one of the known options, so that a typo does not silently
+ * fall back to the default behaviour.
+ * @param argc
+ * @param argv
+ * @param first index of the first optional argument
+ * @param known NULL terminated list of option names (without "=value")
+ * @return 1 if all options are known, 0 otherwise (an error is printed)
+ */
+int optionsValid(int argc, char **argv, int first, const char **known)
+{
+    int i, k;
+    for (i = first; i < argc; ++i)
+    {
+        size_t length = strcspn(argv[i], "=");
+        int found = 0;
+        for (k = 0; known[k]; ++k)
+        {
+            if (strlen(known[k]) == length && strncmp(argv[i], known[k], length) == 0)
+            {
+                found = 1;
+                break;
+            }
+        }
+        if (!found)
+        {
+            fprintf(stderr, "Unknown option \"%s\"\n", argv[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#ifdef WITH_PNG
+#include <png.h>
+#include <setjmp.h>
+#endif
+
+/**
+ * PNG images, read and written directly instead of going through scripts/image_to_text.py and
+ * scripts/text_to_image.py: the gray levels above 128 are white (1), the others black (-1), and the output is a 1 bit
+ * grayscale PNG. Compile with -DWITH_PNG and link with -lpng, without it a PNG path is an error.
+ * Needs arena.c, image_io.c and rle.c.
+ */
+
+/**
+ * @param path
+ * @return whether the file name ends with ".png"
+ */
+int isPngPath(const char *path)
+{
+    size_t length = strlen(path);
+    return length >= 4 && strcasecmp(path + length - 4, ".png") == 0;
+}
+
+#ifdef WITH_PNG
+/**
+ * Read a PNG image of any type as -1 and 1 pixels, with the thresholding of scripts/image_to_text.py: colours are
+ * converted to gray with the same weights as PIL, the alpha channel is ignored.
+ * The gray levels are decoded straight into the pixel buffer, and thresholded in place.
+ * @param memory
+ * @param path
+ * @param rowCount
+ * @param columnCount
+ * @return the pixels, row after row, or NULL (an error is printed)
+ */
+char *readPngImage(arena *memory, const char *path, int *rowCount, int *columnCount)
+{
+    FILE *inputFile = fopen(path, "rb");
+    if (!inputFile)
+    {
+        fprintf(stderr, "Cannot open the input file \"%s\"\n", path);
+        return NULL;
+    }
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    png_bytep *volatile rows = NULL;
+    char *pixels;
+    if (!info || setjmp(png_jmpbuf(png)))
+    {
+        fprintf(stderr, "\"%s\" is not a valid PNG image\n", path);
+        png_destroy_read_struct(&png, &info, NULL);
+        free(rows);
+        fclose(inputFile);
+        return NULL;
+    }
+    png_init_io(png, inputFile);
+    png_read_info(png, info);
+    int colorType = png_get_color_type(png, info);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_strip_alpha(png);
+    if (colorType & PNG_COLOR_MASK_COLOR)
+    {
+        // ITU-R 601 weights, as PIL's convert('L')
+        png_set_rgb_to_gray_fixed(png, 1, 29900, 58700);
+    }
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    *rowCount = (int)png_get_image_height(png, info);
+    *columnCount = (int)png_get_image_width(png, info);
+
+    pixels = (char *)arenaAlloc(memory, (size_t)*rowCount * *columnCount);
+    rows = (png_bytep *)malloc(*rowCount * sizeof(png_bytep));
+    if (!pixels || !rows)
+    {
+        fprintf(stderr, "Not enough memory to read \"%s\"\n", path);
+        png_destroy_read_struct(&png, &info, NULL);
+        free(rows);
+        fclose(inputFile);
+        return NULL;
+    }
+    int row;
+    for (row = 0; row < *rowCount; ++row)
+    {
+        rows[row] = (png_bytep)pixels + (size_t)row * *columnCount;
+    }
+    png_read_image(png, rows);
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    free(rows);
+    fclose(inputFile);
+
+    size_t i, size = (size_t)*rowCount * *columnCount;
+    for (i = 0; i < size; ++i)
+    {
+        pixels[i] = (unsigned char)pixels[i] > 128 ? 1 : -1;
+    }
+    return pixels;
+}
+
+/**
+ * Write -1 and 1 pixels as a 1 bit grayscale PNG (1 is white).
+ * @param path
+ * @param lattice
+ * @param rowCount
+ * @param columnCount
+ * @return 0 on success, 1 otherwise (an error is printed)
+ */
+int writePngImage(const char *path, char **lattice, int rowCount, int columnCount)
+{
+    FILE *outputFile = fopen(path, "wb");
+    if (!outputFile)
+    {
+        fprintf(stderr, "Cannot open the output file \"%s\"\n", path);
+        return 1;
+    }
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    png_bytep packed = (png_bytep)malloc((columnCount + 7) / 8);
+    if (!info || !packed || setjmp(png_jmpbuf(png)))
+    {
+        fprintf(stderr, "Cannot write the PNG image \"%s\"\n", path);
+        png_destroy_write_struct(&png, &info);
+        free(packed);
+        fclose(outputFile);
+        return 1;
+    }
+    png_init_io(png, outputFile);
+    png_set_IHDR(png, info, columnCount, rowCount, 1, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    int row, column;
+    for (row = 0; row < rowCount; ++row)
+    {
+        // 8 pixels per byte, the first one in the most significant bit
+        memset(packed, 0, (columnCount + 7) / 8);
+        for (column = 0; column < columnCount; ++column)
+        {
+            packed[column >> 3] |= (lattice[row][column] > 0) << (7 - (column & 7));
+        }
+        png_write_row(png, packed);
+    }
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    free(packed);
+    return fclose(outputFile) == 0 ? 0 : 1;
+}
+#else
+char *readPngImage(arena *memory, const char *path, int *rowCount, int *columnCount)
+{
+    (void)memory;
+    (void)rowCount;
+    (void)columnCount;
+    fprintf(stderr, "Cannot read \"%s\": compile with -DWITH_PNG -lpng for PNG images\n", path);
+    return NULL;
+}
+
+int writePngImage(const char *path, char **lattice, int rowCount, int columnCount)
+{
+    (void)lattice;
+    (void)rowCount;
+    (void)columnCount;
+    fprintf(stderr, "Cannot write \"%s\": compile with -DWITH_PNG -lpng for PNG images\n", path);
+    return 1;
+}
+#endif
+
+/**
+ * Read a PNG image if the path ends with ".png", a run-length encoded one if it is a ".rle" (see isRlePath()), a text
+ * image otherwise (see readTextImage()).
+ */
+char *readImage(arena *memory, const char *path, int *rowCount, int *columnCount)
+{
+    if (isPngPath(path))
+    {
+        return readPngImage(memory, path, rowCount, columnCount);
+    }
+    return isRlePath(path) ? readRleImage(memory, path, rowCount, columnCount)
+                           : readTextImage(memory, path, rowCount, columnCount);
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+ * Wall clock time and data TLB misses of a region of the program, replacing the PAPI timers.
+ * The counters include the threads created after profileStart(). When perf events are not available (e.g.
+ * kernel.perf_event_paranoid is too high) only the time is reported.
+ */
+typedef struct profile
+{
+    struct timespec start;
+    int loadMisses;
+    int storeMisses;
+} profile;
+
+int openTlbCounter(int operation)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (operation << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void profileStart(profile *region)
+{
+    region->loadMisses = openTlbCounter(PERF_COUNT_HW_CACHE_OP_READ);
+    region->storeMisses = openTlbCounter(PERF_COUNT_HW_CACHE_OP_WRITE);
+    if (region->loadMisses >= 0)
+    {
+        ioctl(region->loadMisses, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    if (region->storeMisses >= 0)
+    {
+        ioctl(region->storeMisses, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &region->start);
+}
+
+/**
+ * Print the running time and TLB misses since profileStart().
+ * @param region
+ * @param name
+ * @return the elapsed seconds
+ */
+double profileStop(profile *region, const char *name)
+{
+    struct timespec stop;
+    long long loadMisses = -1, storeMisses = -1;
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double seconds = (stop.tv_sec - region->start.tv_sec) + (stop.tv_nsec - region->start.tv_nsec) / 1e9;
+    if (region->loadMisses >= 0)
+    {
+        if (read(region->loadMisses, &loadMisses, sizeof(loadMisses)) != sizeof(loadMisses))
+        {
+            loadMisses = -1;
+        }
+        close(region->loadMisses);
+    }
+    if (region->storeMisses >= 0)
+    {
+        if (read(region->storeMisses, &storeMisses, sizeof(storeMisses)) != sizeof(storeMisses))
+        {
+            storeMisses = -1;
+        }
+        close(region->storeMisses);
+    }
+    if (loadMisses < 0 && storeMisses < 0)
+    {
+        printf("Running time (%s): %.3fs, dTLB misses: unavailable\n", name, seconds);
+    }
+    else
+    {
+        printf("Running time (%s): %.3fs, dTLB load misses: %lld, dTLB store misses: %lld\n", name, seconds,
+               loadMisses, storeMisses);
+    }
+    return seconds;
+}
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Run-length encoded lattices, for document scans that are mostly long runs of one colour: a row is the lengths of
+ * its runs, alternately white (1) and black (-1) starting with white (the first run is empty when the row starts
+ * black), each as a LEB128 varint (7 bits per byte, the high bit set on all but the last byte).
+ * A run of n >= 1 pixels never takes more than n bytes, so an encoded row is at most RLE_ROW_BOUND(columns) bytes
+ * whatever the image, and a page of text shrinks by one or two orders of magnitude.
+ * A ".rle" file is RLE_MAGIC, the row and column counts as varints, then every row as its encoded size (a varint)
+ * followed by its runs. The file goes through openImageStream(), so ".rle.gz" and ".rle.zst" work as well.
+ * Needs arena.c and stream.c.
+ */
+
+#define RLE_MAGIC "IRLE"
+/* one byte per pixel at worst, plus the empty first run */
+#define RLE_ROW_BOUND(columns) ((size_t)(columns) + 1)
+/* a varint of an int takes at most 5 bytes */
+#define RLE_VARINT_BYTES 5
+
+/**
+ * @param path
+ * @return whether the file is run-length encoded (".rle", possibly followed by ".gz" or ".zst")
+ */
+int isRlePath(const char *path)
+{
+    size_t length = strlen(path);
+    if (hasExtension(path, ".gz"))
+    {
+        length -= 3;
+    }
+    else if (hasExtension(path, ".zst"))
+    {
+        length -= 4;
+    }
+    return length >= 4 && strncmp(path + length - 4, ".rle", 4) == 0;
+}
+
+/**
+ * Length of the run that starts at the first pixel, 8 pixels at a time: a word of pixels is xor-ed with the colour
+ * of the run repeated, and the first non zero byte is where the run ends.
+ * @param pixels
+ * @param count pixels available, at least 1
+ * @return the run length, between 1 and count
+ */
+int rleRunLength(const char *pixels, int count)
+{
+    uint64_t pattern = 0x0101010101010101ULL * (unsigned char)pixels[0];
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, pixels + i, 8);
+        word ^= pattern;
+        if (word)
+        {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return i + __builtin_clzll(word) / 8;
+#else
+            return i + __builtin_ctzll(word) / 8;
+#endif
+        }
+    }
+    while (i < count && pixels[i] == pixels[0])
+    {
+        ++i;
+    }
+    return i;
+}
+
+/**
+ * @param value
+ * @param out room for RLE_VARINT_BYTES
+ * @return the bytes written
+ */
+int rleWriteVarint(unsigned int value, unsigned char *out)
+{
+    int size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = (unsigned char)value;
+    return size;
+}
+
+/**
+ * @param in
+ * @param size bytes available
+ * @param value
+ * @return the bytes read, or -1 if the varint is truncated or too long
+ */
+int rleReadVarint(const unsigned char *in, int size, unsigned int *value)
+{
+    unsigned int result = 0;
+    int i;
+    for (i = 0; i < size && i < RLE_VARINT_BYTES; ++i)
+    {
+        result |= (unsigned int)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80))
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Encode a row of -1 and 1 pixels.
+ * @param row
+ * @param columns
+ * @param out room for RLE_ROW_BOUND(columns) bytes
+ * @return the bytes written
+ */
+int encodeRleRow(const char *row, int columns, unsigned char *out)
+{
+    int size = 0, column = 0;
+    if (columns > 0 && row[0] < 0)
+    {
+        // empty white run
+        out[size++] = 0;
+    }
+    while (column < columns)
+    {
+        int run = rleRunLength(row + column, columns - column);
+        size += rleWriteVarint((unsigned int)run, out + size);
+        column += run;
+    }
+    return size;
+}
+
+/**
+ * Decode a row written by encodeRleRow(), one memset() per run.
+ * @param in
+ * @param size bytes of the encoded row
+ * @param row
+ * @param columns
+ * @return 0 on success, -1 if the runs do not add up to the columns
+ */
+int decodeRleRow(const unsigned char *in, int size, char *row, int columns)
+{
+    int position = 0, column = 0;
+    char colour = 1;
+    while (position < size)
+    {
+        unsigned int run;
+        int read = rleReadVarint(in + position, size - position, &run);
+        if (read < 0 || run > (unsigned int)(columns - column))
+        {
+            return -1;
+        }
+        memset(row + column, colour, run);
+        column += (int)run;
+        position += read;
+        colour = (char)-colour;
+    }
+    return column == columns ? 0 : -1;
+}
+
+/**
+ * @param file
+ * @param value
+ * @return 0 on success, -1 at the end of the file or on a malformed varint
+ */
+int rleGetVarint(FILE *file, unsigned int *value)
+{
+    unsigned int result = 0;
+    int i, byte;
+    for (i = 0; i < RLE_VARINT_BYTES && (byte = getc(file)) != EOF; ++i)
+    {
+        result |= (unsigned int)(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Read the header of a ".rle" stream.
+ * @param file
+ * @param rowCount
+ * @param columnCount
+ * @return 0 on success, 1 if it is not a valid header
+ */
+int readRleHeader(FILE *file, int *rowCount, int *columnCount)
+{
+    char magic[4];
+    unsigned int rows, columns;
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, RLE_MAGIC, 4) != 0 || rleGetVarint(file, &rows) ||
+        rleGetVarint(file, &columns) || rows == 0 || columns == 0 || rows > INT32_MAX || columns > INT32_MAX)
+    {
+        return 1;
+    }
+    *rowCount = (int)rows;
+    *columnCount = (int)columns;
+    return 0;
+}
+
+/**
+ * Read only the size of a ".rle" image.
+ * @param path
+ * @param rowCount
+ * @param columnCount
+ * @return 0 on success, 1 otherwise (an error is printed)
+ */
+int rleImageSize(const char *path, int *rowCount, int *columnCount)
+{
+    FILE *inputFile = openImageStream(path, "r");
+    if (!inputFile)
+    {
+        fprintf(stderr, "Cannot open the input file \"%s\"\n", path);
+        return 1;
+    }
+    int error = readRleHeader(inputFile, rowCount, columnCount);
+    if (error)
+    {
+        fprintf(stderr, "\"%s\" is not a valid RLE image\n", path);
+    }
+    fclose(inputFile);
+    return error;
+}
+
+/**
+ * Read the next row of a ".rle" stream.
+ * @param file
+ * @param buffer room for RLE_ROW_BOUND(columns) bytes
+ * @param row
+ * @param columns
+ * @return 0 on success, 1 otherwise
+ */
+int readRleRow(FILE *file, unsigned char *buffer, char *row, int columns)
+{
+    unsigned int size;
+    return rleGetVarint(file, &size) || size > RLE_ROW_BOUND(columns) || fread(buffer, 1, size, file) != size ||
+           decodeRleRow(buffer, (int)size, row, columns) != 0;
+}
+
+/**
+ * Read a ".rle" image.
+ * @param memory
+ * @param path
+ * @param rowCount
+ * @param columnCount
+ * @return the pixels, row after row, or NULL (an error is printed)
+ */
+char *readRleImage(arena *memory, const char *path, int *rowCount, int *columnCount)
+{
+    FILE *inputFile = openImageStream(path, "r");
+    if (!inputFile)
+    {
+        fprintf(stderr, "Cannot open the input file \"%s\"\n", path);
+        return NULL;
+    }
+    if (readRleHeader(inputFile, rowCount, columnCount))
+    {
+        fprintf(stderr, "\"%s\" is not a valid RLE image\n", path);
+        fclose(inputFile);
+        return NULL;
+    }
+    char *pixels = (char *)arenaAlloc(memory, (size_t)*rowCount * *columnCount);
+    unsigned char *buffer = (unsigned char *)malloc(RLE_ROW_BOUND(*columnCount));
+    if (!pixels || !buffer)
+    {
+        fprintf(stderr, "Not enough memory to read \"%s\"\n", path);
+        free(buffer);
+        fclose(inputFile);
+        return NULL;
+    }
+    int row;
+    for (row = 0; row < *rowCount; ++row)
+    {
+        if (readRleRow(inputFile, buffer, pixels + (size_t)row * *columnCount, *columnCount))
+        {
+            fprintf(stderr, "Cannot read row %d of \"%s\"\n", row, path);
+            free(buffer);
+            fclose(inputFile);
+            return NULL;
+        }
+    }
+    free(buffer);
+    fclose(inputFile);
+    return pixels;
+}
+
+/**
+ * Write -1 and 1 pixels as a ".rle" image.
+ * @param path
+ * @param lattice
+ * @param rowCount
+ * @param columnCount
+ * @return 0 on success, 1 otherwise (an error is printed)
+ */
+int writeRleImage(const char *path, char **lattice, int rowCount, int columnCount)
+{
+    FILE *outputFile = openImageStream(path, "w");
+    unsigned char *buffer = (unsigned char *)malloc(RLE_VARINT_BYTES + RLE_ROW_BOUND(columnCount));
+    unsigned char header[4 + 2 * RLE_VARINT_BYTES];
+    int error = !outputFile || !buffer, row;
+    if (!error)
+    {
+        memcpy(header, RLE_MAGIC, 4);
+        int size = 4 + rleWriteVarint((unsigned int)rowCount, header + 4);
+        size += rleWriteVarint((unsigned int)columnCount, header + size);
+        error = fwrite(header, 1, size, outputFile) != (size_t)size;
+    }
+    for (row = 0; !error && row < rowCount; ++row)
+    {
+        // the runs go after the room for their size, which is then moved right in front of them
+        int size = encodeRleRow(lattice[row], columnCount, buffer + RLE_VARINT_BYTES);
+        unsigned char prefix[RLE_VARINT_BYTES];
+        int prefixSize = rleWriteVarint((unsigned int)size, prefix);
+        memcpy(buffer + RLE_VARINT_BYTES - prefixSize, prefix, prefixSize);
+        error = fwrite(buffer + RLE_VARINT_BYTES - prefixSize, 1, prefixSize + size, outputFile) !=
+                (size_t)(prefixSize + size);
+    }
+    error |= outputFile && fclose(outputFile) != 0;
+    free(buffer);
+    if (error)
+    {
+        fprintf(stderr, "Cannot write the RLE image \"%s\"\n", path);
+    }
+    return error;
+}
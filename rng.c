@@ -0,0 +1,86 @@
+#include <stdint.h>
+
+/**
+ * State of an integer-only pseudo random generator (xorshift64*).
+ * Unlike rand() it has no hidden global state, so every thread or engine can own one.
+ */
+typedef struct rng
+{
+    uint64_t state;
+} rng;
+
+/**
+ * Seed a generator. Any seed is fine (including 0): it is scrambled with a splitmix64 step first.
+ * @param generator
+ * @param seed
+ */
+void seedRandom(rng *generator, uint64_t seed)
+{
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    generator->state = z ? z : 0x9e3779b97f4a7c15ULL;
+}
+
+/**
+ * @param generator
+ * @return uniformly distributed 32 bits
+ */
+uint32_t nextRandom(rng *generator)
+{
+    uint64_t x = generator->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    generator->state = x;
+    return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/**
+ * Uniform integer in [0, bound) with a multiply and a shift instead of a division.
+ * @param generator
+ * @param bound
+ * @return
+ */
+uint32_t nextBounded(rng *generator, uint32_t bound)
+{
+    return (uint32_t)(((uint64_t)nextRandom(generator) * bound) >> 32);
+}
+
+/**
+ * Key of the counter based generator: with it the random number of a pixel only depends on the seed, the sweep and
+ * the global coordinates of the pixel, not on the order of the updates nor on who runs them.
+ * rowOffset and columnOffset turn the coordinates of a tile into global ones.
+ */
+typedef struct pixelKey
+{
+    uint64_t seed;
+    uint64_t sweep;
+    int rowOffset;
+    int columnOffset;
+} pixelKey;
+
+/**
+ * One splitmix64 step, a bijection of 64 bits that mixes well.
+ */
+uint64_t mixBits(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Counter based random number of a pixel in the sweep of the key.
+ * @param key
+ * @param row row of the pixel in the tile
+ * @param column column of the pixel in the tile
+ * @return uniformly distributed 32 bits
+ */
+uint32_t pixelRandom(const pixelKey *key, int row, int column)
+{
+    uint64_t counter = (uint64_t)(uint32_t)(row + key->rowOffset) << 32 | (uint32_t)(column + key->columnOffset);
+    uint64_t z = mixBits(key->seed + key->sweep * 0x9e3779b97f4a7c15ULL);
+    return (uint32_t)(mixBits(z ^ mixBits(counter + 0x9e3779b97f4a7c15ULL)) >> 32);
+}
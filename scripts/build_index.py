@@ -0,0 +1,26 @@
+import os
+import sys
+
+# usage: python build_index.py <text_image> [stride]
+# writes <text_image>.idx, the row index read by the denoisers (see textIndex in image_io.c): the size of the image
+# and the byte offset of every stride-th non empty line, so that the loaders can jump straight to their rows
+path = sys.argv[1]
+stride = int(sys.argv[2]) if len(sys.argv) > 2 else 1024
+
+rows, columns, offset, offsets = 0, 0, 0, []
+with open(path, "rb") as file:
+	for line in file:
+		if line.strip():
+			if rows == 0:
+				columns = len(line.split())
+			if rows % stride == 0:
+				offsets.append(offset)
+			rows += 1
+		offset += len(line)
+
+info = os.stat(path)
+with open(path + ".idx", "w") as index:
+	index.write("image-index 1\n%d %d %d %d %d\n" % (rows, columns, stride, info.st_size, info.st_mtime_ns))
+	for rowOffset in offsets:
+		index.write("%d\n" % rowOffset)
+print("%s: %d x %d, %d offsets" % (path, rows, columns, len(offsets)))
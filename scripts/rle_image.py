@@ -0,0 +1,63 @@
+import sys
+
+# usage: python rle_image.py <input> <output>
+# converts a text image to the run-length encoded format of the denoisers (see rle.c) when the output ends with
+# ".rle", and an RLE image back to text otherwise
+def writeVarint(file, value):
+	while value >= 0x80:
+		file.write(bytes([(value & 0x7f) | 0x80]))
+		value >>= 7
+	file.write(bytes([value]))
+
+def readVarint(data, position):
+	value, shift = 0, 0
+	while True:
+		byte = data[position]
+		position += 1
+		value |= (byte & 0x7f) << shift
+		shift += 7
+		if not byte & 0x80:
+			return value, position
+
+def encodeRow(row):
+	runs, colour, length = [], 1, 0
+	for pixel in row:
+		if pixel == colour:
+			length += 1
+		else:
+			runs.append(length)
+			colour, length = -colour, 1
+	runs.append(length)
+	encoded = bytearray()
+	for run in runs:
+		while run >= 0x80:
+			encoded.append((run & 0x7f) | 0x80)
+			run >>= 7
+		encoded.append(run)
+	return encoded
+
+if sys.argv[2].endswith(".rle"):
+	rows = [[int(pixel) for pixel in line.split()] for line in open(sys.argv[1]) if line.strip()]
+	with open(sys.argv[2], "wb") as file:
+		file.write(b"IRLE")
+		writeVarint(file, len(rows))
+		writeVarint(file, len(rows[0]))
+		for row in rows:
+			encoded = encodeRow(row)
+			writeVarint(file, len(encoded))
+			file.write(encoded)
+else:
+	data = open(sys.argv[1], "rb").read()
+	if data[:4] != b"IRLE":
+		sys.exit("%s is not an RLE image" % sys.argv[1])
+	rowCount, position = readVarint(data, 4)
+	columnCount, position = readVarint(data, position)
+	with open(sys.argv[2], "w") as file:
+		for _ in range(rowCount):
+			size, position = readVarint(data, position)
+			end, colour, row = position + size, 1, []
+			while position < end:
+				run, position = readVarint(data, position)
+				row += [colour] * run
+				colour = -colour
+			file.write(" ".join("%d" % pixel for pixel in row) + "\n")
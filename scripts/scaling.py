@@ -0,0 +1,20 @@
+import re
+import subprocess
+import sys
+
+# usage: python scaling.py <denoiser> <input> <output> <beta> <pi> [max_threads] [other denoiser options...]
+# runs the pthreads denoiser with 1, 2, 4, ... threads and prints the speedup of the sampling phase
+binary, args = sys.argv[1], sys.argv[2:6]
+maxThreads = int(sys.argv[6]) if len(sys.argv) > 6 else 16
+options = sys.argv[7:]
+
+base = None
+threads = 1
+print("threads  seconds  speedup  efficiency")
+while threads <= maxThreads:
+	output = subprocess.run([binary] + args + ["--threads=" + str(threads)] + options,
+	                        capture_output=True, text=True, check=True).stdout
+	seconds = float(re.search(r"Sampling time with \d+ threads: ([0-9.]+)s", output).group(1))
+	base = base or seconds
+	print("%7d  %7.3f  %7.2f  %9.0f%%" % (threads, seconds, base / seconds, 100 * base / seconds / threads))
+	threads *= 2
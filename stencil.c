@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Neighbourhood stencils.
+ * Every stencil is an X-macro listing its neighbours as X(row offset, column offset, weight); the macros below expand
+ * it into a fully unrolled, branch-free sum for pixels far enough from the borders, and into a bounds-checked sum for
+ * the others (which, like summer(), ignores the neighbours outside of the lattice, and also works for a center just
+ * outside of it).
+ */
+#define NEIGHBOURHOOD_4(X) \
+    X(-1, 0, 1)            \
+    X(0, -1, 1)            \
+    X(0, 1, 1)             \
+    X(1, 0, 1)
+
+#define NEIGHBOURHOOD_8(X) \
+    NEIGHBOURHOOD_4(X)     \
+    X(-1, -1, 1)           \
+    X(-1, 1, 1)            \
+    X(1, -1, 1)            \
+    X(1, 1, 1)
+
+/* 5x5 neighbourhood weighted by 8 / squared distance (rounded), scale 8 so that the nearest neighbours weigh 1 */
+#define NEIGHBOURHOOD_24(X)                                                      \
+    X(-1, 0, 8) X(0, -1, 8) X(0, 1, 8) X(1, 0, 8)                                \
+    X(-1, -1, 4) X(-1, 1, 4) X(1, -1, 4) X(1, 1, 4)                              \
+    X(-2, 0, 2) X(0, -2, 2) X(0, 2, 2) X(2, 0, 2)                                \
+    X(-2, -1, 2) X(-2, 1, 2) X(-1, -2, 2) X(-1, 2, 2)                            \
+    X(1, -2, 2) X(1, 2, 2) X(2, -1, 2) X(2, 1, 2)                                \
+    X(-2, -2, 1) X(-2, 2, 1) X(2, -2, 1) X(2, 2, 1)
+
+/* every stencil as X(name, neighbourhood, radius), to instantiate the code that depends on the stencil once per stencil */
+#define STENCILS(X)                       \
+    X(stencil4, NEIGHBOURHOOD_4, 1)       \
+    X(stencil8, NEIGHBOURHOOD_8, 1)       \
+    X(stencil24, NEIGHBOURHOOD_24, 2)
+
+/* the largest total weight of a stencil, the neighbour sums are always within [-MAX_STENCIL_WEIGHT, MAX_STENCIL_WEIGHT] */
+#define MAX_STENCIL_WEIGHT 76
+
+#define STENCIL_TERM(rowOffset, columnOffset, weight) +(weight) * lattice[row + (rowOffset)][column + (columnOffset)]
+
+#define STENCIL_BOUNDED_TERM(rowOffset, columnOffset, weight)                         \
+    if ((unsigned)(row + (rowOffset)) < (unsigned)rows &&                             \
+        (unsigned)(column + (columnOffset)) < (unsigned)columns)                      \
+    {                                                                                 \
+        sum += (weight) * lattice[row + (rowOffset)][column + (columnOffset)];        \
+    }
+
+#define STENCIL_OFFSET(rowOffset, columnOffset, weight) {rowOffset, columnOffset, weight},
+
+#define STENCIL_WEIGHT(rowOffset, columnOffset, weight) +(weight)
+
+#define STENCIL_KIND(name, NEIGHBOURHOOD, radius) name##Kind,
+
+/* the sums are static inline, so that a loop instantiated for one stencil inlines its unrolled interior sum */
+#define DEFINE_STENCIL(name, NEIGHBOURHOOD, radius)                                               \
+    static inline int name##Interior(char **lattice, int row, int column)                        \
+    {                                                                                             \
+        return 0 NEIGHBOURHOOD(STENCIL_TERM);                                                     \
+    }                                                                                             \
+    static int name##Bounded(char **lattice, int rows, int columns, int row, int column)         \
+    {                                                                                             \
+        int sum = 0;                                                                              \
+        NEIGHBOURHOOD(STENCIL_BOUNDED_TERM)                                                       \
+        return sum;                                                                               \
+    }                                                                                             \
+    static inline int name##Sum(char **lattice, int rows, int columns, int row, int column)      \
+    {                                                                                             \
+        if (row >= (radius) && row < rows - (radius) && column >= (radius) && column < columns - (radius)) \
+        {                                                                                         \
+            return name##Interior(lattice, row, column);                                         \
+        }                                                                                         \
+        return name##Bounded(lattice, rows, columns, row, column);                               \
+    }                                                                                             \
+    const signed char name##Offsets[][3] = {NEIGHBOURHOOD(STENCIL_OFFSET)};
+
+STENCILS(DEFINE_STENCIL)
+
+enum stencilKind
+{
+    STENCILS(STENCIL_KIND)
+};
+
+typedef int (*stencilSum)(char **lattice, int rows, int columns, int row, int column);
+
+/**
+ * A stencil selectable at runtime.
+ * kind selects the copy of a loop instantiated for the stencil (see sweepTile()), sum computes the weighted neighbour sum of a pixel, offsets lists the (row offset, column offset, weight) of every
+ * neighbour for the code that has to walk the neighbourhood (e.g. to update cached sums after a flip), and beta must
+ * be divided by scale to keep the meaning of beta for the nearest neighbours.
+ */
+typedef struct stencil
+{
+    const char *name;
+    enum stencilKind kind;
+    int radius;
+    int scale;
+    int totalWeight;
+    int count;
+    const signed char (*offsets)[3];
+    stencilSum sum;
+} stencil;
+
+const stencil stencils[] = {
+    {"8", stencil8Kind, 1, 1, 0 NEIGHBOURHOOD_8(STENCIL_WEIGHT), 8, stencil8Offsets, stencil8Sum},
+    {"4", stencil4Kind, 1, 1, 0 NEIGHBOURHOOD_4(STENCIL_WEIGHT), 4, stencil4Offsets, stencil4Sum},
+    {"24", stencil24Kind, 2, 8, 0 NEIGHBOURHOOD_24(STENCIL_WEIGHT), 24, stencil24Offsets, stencil24Sum},
+};
+
+/**
+ * Find a stencil by its --neighborhood name ("4", "8" or "24"), NULL selects the default 8-neighbourhood.
+ * @param name
+ * @return the stencil, or NULL (and an error is printed) for an unknown name
+ */
+const stencil *findStencil(const char *name)
+{
+    int i;
+    if (!name)
+    {
+        return stencils;
+    }
+    for (i = 0; i < (int)(sizeof(stencils) / sizeof(stencils[0])); ++i)
+    {
+        if (strcmp(stencils[i].name, name) == 0)
+        {
+            return stencils + i;
+        }
+    }
+    fprintf(stderr, "Unknown neighborhood \"%s\", use 4, 8 or 24\n", name);
+    return NULL;
+}
+
+#define STENCIL_SUM_CASE(name, NEIGHBOURHOOD, radius) \
+    case name##Kind:                                  \
+        return name##Sum(lattice, rows, columns, row, column);
+
+/**
+ * Neighbour sum with a switch on the kind of the stencil instead of a call through its sum pointer, so that the sum
+ * of every stencil is inlined: for the code that picks pixels at random, where there is no loop to instantiate.
+ * @param neighbourhood
+ * @param lattice
+ * @param rows
+ * @param columns
+ * @param row
+ * @param column
+ * @return the weighted sum of the neighbours inside the lattice
+ */
+static inline int stencilSumOf(const stencil *neighbourhood, char **lattice, int rows, int columns, int row,
+                               int column)
+{
+    switch (neighbourhood->kind)
+    {
+        STENCILS(STENCIL_SUM_CASE)
+    }
+    return neighbourhood->sum(lattice, rows, columns, row, column);
+}
@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * Compressed image files, read and written as plain streams: a path ending with ".gz" or ".zst" is opened as a FILE
+ * (with fopencookie()) that compresses or decompresses on the fly, so the loaders and writers work unchanged and the
+ * text never touches the disk uncompressed.
+ * gzip goes through zlib when compiled with -DWITH_ZLIB (-lz), zstd through libzstd with -DWITH_ZSTD (-lzstd
+ * -lpthread); without them the gzip and zstd commands run in a pipe.
+ * The zstd files are written as a sequence of independent frames of ZSTD_FRAME_BYTES, and the frames of a file are
+ * decompressed in parallel, up to one per core at a time.
+ * The including program must define _GNU_SOURCE before its first #include.
+ */
+
+#define ZSTD_FRAME_BYTES (4 << 20)
+/* frames larger than that (or of unknown size) are streamed instead of decompressed in parallel */
+#define ZSTD_PARALLEL_BYTES (64 << 20)
+#define ZSTD_MAX_THREADS 16
+
+/**
+ * @param path
+ * @param extension
+ * @return whether the file name ends with the extension
+ */
+int hasExtension(const char *path, const char *extension)
+{
+    size_t length = strlen(path), extensionLength = strlen(extension);
+    return length >= extensionLength && strcmp(path + length - extensionLength, extension) == 0;
+}
+
+/**
+ * @param path
+ * @return whether the file is compressed (".gz" or ".zst")
+ */
+int isCompressedPath(const char *path)
+{
+    return hasExtension(path, ".gz") || hasExtension(path, ".zst");
+}
+
+/* compression command in a pipe */
+
+ssize_t pipeRead(void *cookie, char *buffer, size_t size)
+{
+    size_t read = fread(buffer, 1, size, (FILE *)cookie);
+    return read == 0 && ferror((FILE *)cookie) ? -1 : (ssize_t)read;
+}
+
+ssize_t pipeWrite(void *cookie, const char *buffer, size_t size)
+{
+    return (ssize_t)fwrite(buffer, 1, size, (FILE *)cookie);
+}
+
+int pipeClose(void *cookie)
+{
+    return pclose((FILE *)cookie) == 0 ? 0 : EOF;
+}
+
+/**
+ * Run "<command> '<path>'" for reading, or "<command> > '<path>'" for writing, through the shell.
+ * @param command
+ * @param path
+ * @param mode "r" or "w"
+ * @return
+ */
+FILE *pipeStream(const char *command, const char *path, const char *mode)
+{
+    // the path is single quoted, its own single quotes become '\''
+    char line[strlen(command) + 4 * strlen(path) + 8];
+    char *end = line + sprintf(line, "%s %s'", command, mode[0] == 'w' ? ">" : "");
+    const char *character;
+    for (character = path; *character; ++character)
+    {
+        end = *character == '\'' ? end + sprintf(end, "'\\''") : end + sprintf(end, "%c", *character);
+    }
+    sprintf(end, "'");
+    FILE *pipe = popen(line, mode);
+    if (!pipe)
+    {
+        return NULL;
+    }
+    cookie_io_functions_t functions = {pipeRead, pipeWrite, NULL, pipeClose};
+    return fopencookie(pipe, mode, functions);
+}
+
+#ifdef WITH_ZLIB
+ssize_t gzipRead(void *cookie, char *buffer, size_t size)
+{
+    return gzread((gzFile)cookie, buffer, (unsigned)(size < (1U << 30) ? size : (1U << 30)));
+}
+
+ssize_t gzipWrite(void *cookie, const char *buffer, size_t size)
+{
+    return gzwrite((gzFile)cookie, buffer, (unsigned)size);
+}
+
+int gzipClose(void *cookie)
+{
+    return gzclose((gzFile)cookie) == Z_OK ? 0 : EOF;
+}
+#endif
+
+#ifdef WITH_ZSTD
+/**
+ * State of a zstd stream.
+ * Reading: the compressed file is mapped; batches of whole frames of known size are decompressed in parallel into
+ * buffer, the other frames are streamed straight into the reader's buffer.
+ * Writing: the text is gathered in buffer and compressed as one frame every ZSTD_FRAME_BYTES.
+ */
+typedef struct zstdStream
+{
+    FILE *file;
+    const unsigned char *mapped;
+    size_t mappedSize;
+    size_t next;       /* offset of the next compressed frame */
+    ZSTD_DStream *decompressor;
+    int streaming;     /* in the middle of a streamed frame */
+    ZSTD_CCtx *compressor;
+    char *buffer;
+    size_t capacity;
+    size_t used;
+    size_t position;   /* read position in buffer */
+    int threads;
+} zstdStream;
+
+typedef struct zstdFrame
+{
+    const unsigned char *source;
+    size_t compressedSize;
+    char *destination;
+    size_t size;
+    size_t result;
+} zstdFrame;
+
+void *decompressFrame(void *arg)
+{
+    zstdFrame *frame = (zstdFrame *)arg;
+    frame->result = ZSTD_decompress(frame->destination, frame->size, frame->source, frame->compressedSize);
+    return NULL;
+}
+
+/**
+ * Decompress the next frames in parallel, as many as there are threads, if their size is known and reasonable.
+ * @param stream
+ * @return the number of frames decompressed, 0 if the next frame has to be streamed, -1 on error
+ */
+int decompressFrames(zstdStream *stream)
+{
+    zstdFrame frames[ZSTD_MAX_THREADS];
+    pthread_t workers[ZSTD_MAX_THREADS];
+    size_t offset = stream->next, total = 0;
+    int count = 0, i;
+    while (count < stream->threads && offset < stream->mappedSize)
+    {
+        size_t compressedSize = ZSTD_findFrameCompressedSize(stream->mapped + offset, stream->mappedSize - offset);
+        unsigned long long size = ZSTD_getFrameContentSize(stream->mapped + offset, stream->mappedSize - offset);
+        if (ZSTD_isError(compressedSize) || size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+            size > ZSTD_PARALLEL_BYTES)
+        {
+            break;
+        }
+        frames[count].source = stream->mapped + offset;
+        frames[count].compressedSize = compressedSize;
+        frames[count].size = (size_t)size;
+        total += (size_t)size;
+        offset += compressedSize;
+        ++count;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (total > stream->capacity)
+    {
+        char *buffer = (char *)realloc(stream->buffer, total);
+        if (!buffer)
+        {
+            return -1;
+        }
+        stream->buffer = buffer;
+        stream->capacity = total;
+    }
+    for (i = 0, total = 0; i < count; ++i)
+    {
+        frames[i].destination = stream->buffer + total;
+        total += frames[i].size;
+        if (i > 0 && pthread_create(workers + i, NULL, decompressFrame, frames + i) != 0)
+        {
+            decompressFrame(frames + i);
+            workers[i] = pthread_self();
+        }
+    }
+    decompressFrame(frames);
+    for (i = 1; i < count; ++i)
+    {
+        if (!pthread_equal(workers[i], pthread_self()))
+        {
+            pthread_join(workers[i], NULL);
+        }
+    }
+    for (i = 0; i < count; ++i)
+    {
+        if (ZSTD_isError(frames[i].result))
+        {
+            fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(frames[i].result));
+            return -1;
+        }
+    }
+    stream->next = offset;
+    stream->used = total;
+    stream->position = 0;
+    return count;
+}
+
+ssize_t zstdRead(void *cookie, char *buffer, size_t size)
+{
+    zstdStream *stream = (zstdStream *)cookie;
+    while (1)
+    {
+        if (stream->position < stream->used)
+        {
+            size_t copied = stream->used - stream->position < size ? stream->used - stream->position : size;
+            memcpy(buffer, stream->buffer + stream->position, copied);
+            stream->position += copied;
+            return (ssize_t)copied;
+        }
+        if (!stream->streaming)
+        {
+            if (stream->next >= stream->mappedSize)
+            {
+                return 0;
+            }
+            int frames = decompressFrames(stream);
+            if (frames < 0)
+            {
+                return -1;
+            }
+            if (frames > 0)
+            {
+                continue;
+            }
+            ZSTD_initDStream(stream->decompressor);
+            stream->streaming = 1;
+        }
+        ZSTD_outBuffer output = {buffer, size, 0};
+        ZSTD_inBuffer input = {stream->mapped, stream->mappedSize, stream->next};
+        size_t result = ZSTD_decompressStream(stream->decompressor, &output, &input);
+        stream->next = input.pos;
+        if (ZSTD_isError(result))
+        {
+            fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(result));
+            return -1;
+        }
+        stream->streaming = result != 0;
+        if (output.pos > 0)
+        {
+            return (ssize_t)output.pos;
+        }
+        if (stream->streaming && input.pos == stream->mappedSize)
+        {
+            fprintf(stderr, "zstd: truncated input\n");
+            return -1;
+        }
+    }
+}
+
+/**
+ * Compress the gathered text as one frame.
+ * @return 0 on success
+ */
+int zstdFlush(zstdStream *stream)
+{
+    if (stream->used == 0)
+    {
+        return 0;
+    }
+    size_t bound = ZSTD_compressBound(stream->used);
+    char *compressed = (char *)malloc(bound);
+    size_t size = compressed ? ZSTD_compress2(stream->compressor, compressed, bound, stream->buffer, stream->used)
+                             : 0;
+    int error = !compressed || ZSTD_isError(size) || fwrite(compressed, 1, size, stream->file) != size;
+    free(compressed);
+    stream->used = 0;
+    return error;
+}
+
+ssize_t zstdWrite(void *cookie, const char *buffer, size_t size)
+{
+    zstdStream *stream = (zstdStream *)cookie;
+    size_t written = 0;
+    while (written < size)
+    {
+        size_t copied = stream->capacity - stream->used < size - written ? stream->capacity - stream->used
+                                                                         : size - written;
+        memcpy(stream->buffer + stream->used, buffer + written, copied);
+        stream->used += copied;
+        written += copied;
+        if (stream->used == stream->capacity && zstdFlush(stream))
+        {
+            return -1;
+        }
+    }
+    return (ssize_t)written;
+}
+
+int zstdClose(void *cookie)
+{
+    zstdStream *stream = (zstdStream *)cookie;
+    int error = 0;
+    if (stream->compressor)
+    {
+        error = zstdFlush(stream);
+        ZSTD_freeCCtx(stream->compressor);
+        error |= fclose(stream->file) != 0;
+    }
+    else
+    {
+        ZSTD_freeDStream(stream->decompressor);
+        munmap((void *)stream->mapped, stream->mappedSize);
+    }
+    free(stream->buffer);
+    free(stream);
+    return error ? EOF : 0;
+}
+
+/**
+ * @param path
+ * @param mode "r" or "w"
+ * @return
+ */
+FILE *zstdStreamOpen(const char *path, const char *mode)
+{
+    zstdStream *stream = (zstdStream *)calloc(1, sizeof(zstdStream));
+    if (!stream)
+    {
+        return NULL;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    stream->threads = cores < 1 ? 1 : cores > ZSTD_MAX_THREADS ? ZSTD_MAX_THREADS : (int)cores;
+    if (mode[0] == 'w')
+    {
+        stream->file = fopen(path, "wb");
+        stream->compressor = ZSTD_createCCtx();
+        stream->capacity = ZSTD_FRAME_BYTES;
+        stream->buffer = (char *)malloc(stream->capacity);
+        if (!stream->file || !stream->compressor || !stream->buffer)
+        {
+            if (stream->file)
+            {
+                fclose(stream->file);
+            }
+            ZSTD_freeCCtx(stream->compressor);
+            free(stream->buffer);
+            free(stream);
+            return NULL;
+        }
+        // ignored by a library without multithreading
+        ZSTD_CCtx_setParameter(stream->compressor, ZSTD_c_nbWorkers, stream->threads);
+    }
+    else
+    {
+        struct stat info;
+        FILE *file = fopen(path, "rb");
+        if (!file || fstat(fileno(file), &info) != 0)
+        {
+            if (file)
+            {
+                fclose(file);
+            }
+            free(stream);
+            return NULL;
+        }
+        stream->mappedSize = (size_t)info.st_size;
+        stream->mapped = stream->mappedSize ? (const unsigned char *)mmap(NULL, stream->mappedSize, PROT_READ,
+                                                                           MAP_PRIVATE, fileno(file), 0)
+                                            : NULL;
+        fclose(file);
+        stream->decompressor = ZSTD_createDStream();
+        if (stream->mapped == MAP_FAILED || !stream->decompressor)
+        {
+            if (stream->mapped != MAP_FAILED && stream->mapped)
+            {
+                munmap((void *)stream->mapped, stream->mappedSize);
+            }
+            ZSTD_freeDStream(stream->decompressor);
+            free(stream);
+            return NULL;
+        }
+    }
+    cookie_io_functions_t functions = {zstdRead, zstdWrite, NULL, zstdClose};
+    FILE *file = fopencookie(stream, mode, functions);
+    if (!file)
+    {
+        zstdClose(stream);
+    }
+    return file;
+}
+#endif
+
+/**
+ * Open an image file for reading or writing, decompressing or compressing it on the fly if its name ends with ".gz"
+ * or ".zst". The stream is closed with fclose().
+ * @param path
+ * @param mode "r" or "w"
+ * @return the stream, or NULL
+ */
+FILE *openImageStream(const char *path, const char *mode)
+{
+    if (hasExtension(path, ".gz"))
+    {
+#ifdef WITH_ZLIB
+        gzFile compressed = gzopen(path, mode[0] == 'w' ? "wb" : "rb");
+        if (!compressed)
+        {
+            return NULL;
+        }
+        gzbuffer(compressed, 1 << 20);
+        cookie_io_functions_t functions = {gzipRead, gzipWrite, NULL, gzipClose};
+        return fopencookie(compressed, mode, functions);
+#else
+        return pipeStream(mode[0] == 'w' ? "gzip -c" : "gzip -dc", path, mode);
+#endif
+    }
+    if (hasExtension(path, ".zst"))
+    {
+#ifdef WITH_ZSTD
+        return zstdStreamOpen(path, mode);
+#else
+        return pipeStream(mode[0] == 'w' ? "zstd -q -T0 -c" : "zstd -q -dc", path, mode);
+#endif
+    }
+    return fopen(path, mode);
+}
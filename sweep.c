@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+/**
+ * Colour-phase sweeps shared by the threaded engines.
+ * The pixels are coloured with a (radius + 1) x (radius + 1) checkerboard, so that no two pixels of the same colour are
+ * neighbours: all the pixels of one colour can be updated in any order, or concurrently, without changing the result
+ * and without data races, as long as the colours are updated one after the other.
+ * Needs stencil.c, rng.c, fixedpoint.c (with fillThresholds() already called) and affinity.c.
+ */
+
+/**
+ * First index >= start that has the given residue modulo side, used to walk the pixels of one colour.
+ */
+int firstOfColor(int start, int residue, int side)
+{
+    return start + ((residue - start % side) % side + side) % side;
+}
+
+/**
+ * sweepTile() for the stencil of the given sum and radius. It is always inlined into the copies made for every stencil
+ * below, where sum is a constant: the unrolled interior sum of the stencil is inlined in the loop.
+ */
+static inline __attribute__((always_inline)) int
+sweepTileWith(stencilSum sum, int radius, char **image, char **lattice, int rows, int columns, int rowStart,
+              int rowEnd, int columnStart, int columnEnd, int color, rng *generator, const pixelKey *key)
+{
+    int side = radius + 1;
+    int rowOffset = key ? key->rowOffset : 0, columnOffset = key ? key->columnOffset : 0;
+    int row, column, flips = 0;
+    for (row = firstOfColor(rowStart + rowOffset, color / side, side) - rowOffset; row < rowEnd; row += side)
+    {
+        for (column = firstOfColor(columnStart + columnOffset, color % side, side) - columnOffset; column < columnEnd;
+             column += side)
+        {
+            int neighbours = sum(lattice, rows, columns, row, column);
+            char *pixel = lattice[row] + column;
+            uint32_t random = key ? pixelRandom(key, row, column) : nextRandom(generator);
+            if (random <= thresholds[image[row][column] > 0][*pixel > 0][neighbours + MAX_STENCIL_WEIGHT])
+            {
+                *pixel = -*pixel;
+                ++flips;
+            }
+        }
+    }
+    return flips;
+}
+
+#define DEFINE_SWEEP_TILE(name, NEIGHBOURHOOD, radius)                                                          \
+    int name##SweepTile(char **image, char **lattice, int rows, int columns, int rowStart, int rowEnd,          \
+                        int columnStart, int columnEnd, int color, rng *generator, const pixelKey *key)         \
+    {                                                                                                           \
+        return sweepTileWith(name##Sum, radius, image, lattice, rows, columns, rowStart, rowEnd, columnStart,   \
+                             columnEnd, color, generator, key);                                                 \
+    }
+
+STENCILS(DEFINE_SWEEP_TILE)
+
+#define SWEEP_TILE_CASE(name, NEIGHBOURHOOD, radius)                                                             \
+    case name##Kind:                                                                                            \
+        return name##SweepTile(image, lattice, rows, columns, rowStart, rowEnd, columnStart, columnEnd, color,  \
+                               generator, key);
+
+/**
+ * Fixed point Metropolis update of all the pixels of one colour in the rectangle
+ * [rowStart, rowEnd) x [columnStart, columnEnd) of the lattice.
+ * The stencil is dispatched once here, to the copy of the loop made for it.
+ * @param image
+ * @param lattice
+ * @param rows
+ * @param columns
+ * @param rowStart
+ * @param rowEnd
+ * @param columnStart
+ * @param columnEnd
+ * @param color
+ * @param neighbourhood
+ * @param generator
+ * @param key NULL to draw from the generator, otherwise the random numbers come from pixelRandom() and the colours
+ * are those of the global coordinates given by its offsets
+ * @return the number of flipped pixels
+ */
+int sweepTile(char **image, char **lattice, int rows, int columns, int rowStart, int rowEnd, int columnStart,
+              int columnEnd, int color, const stencil *neighbourhood, rng *generator, const pixelKey *key)
+{
+    switch (neighbourhood->kind)
+    {
+        STENCILS(SWEEP_TILE_CASE)
+    }
+    return sweepTileWith(neighbourhood->sum, neighbourhood->radius, image, lattice, rows, columns, rowStart, rowEnd,
+                         columnStart, columnEnd, color, generator, key);
+}
+
+#define NO_TILE -1
+#define ABORTED_STEAL -2
+
+/**
+ * Chase-Lev work-stealing deque of tile indices: the owner pushes and takes at the bottom, the other threads steal at
+ * the top. top and bottom only grow, the deque is never reset (so a late thief can never see a stale entry), and
+ * capacity must be at least the number of tiles pushed while it is not empty.
+ */
+typedef struct tileDeque
+{
+    atomic_long top;
+    atomic_long bottom;
+    atomic_int *tiles;
+    long capacity;
+} tileDeque;
+
+void pushTile(tileDeque *deque, int tile)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    atomic_store_explicit(deque->tiles + bottom % deque->capacity, tile, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+/**
+ * @return the most recently pushed tile, or NO_TILE
+ */
+int takeTile(tileDeque *deque)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    int tile = NO_TILE;
+    if (top <= bottom)
+    {
+        tile = atomic_load_explicit(deque->tiles + bottom % deque->capacity, memory_order_relaxed);
+        if (top == bottom)
+        {
+            // last tile, race against the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed))
+            {
+                tile = NO_TILE;
+            }
+            atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return tile;
+}
+
+/**
+ * @return the oldest tile, NO_TILE if the deque is empty, or ABORTED_STEAL if another thread got it first
+ */
+int stealTile(tileDeque *deque)
+{
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+    {
+        return NO_TILE;
+    }
+    int tile = atomic_load_explicit(deque->tiles + top % deque->capacity, memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed))
+    {
+        return ABORTED_STEAL;
+    }
+    return tile;
+}
+
+/**
+ * Work shared by all the threads of a banded sweep.
+ * With tileSize > 0 the lattice is also split in square tiles which are scheduled by work stealing:
+ * remaining[phase % 2] counts the tiles of a phase that are not done yet.
+ */
+typedef struct sweepJob
+{
+    char **image;
+    char **lattice;
+    int rows;
+    int columns;
+    int sweeps;
+    const stencil *neighbourhood;
+    int threads;
+    int keyed;
+    uint64_t seed;
+    int tileSize;
+    int tileColumns;
+    int tileCount;
+    tileDeque *deques;
+    atomic_int remaining[2];
+    pthread_barrier_t barrier;
+    /* 0 until every thread was created, then 1 to start sweeping, or -1 if some could not be created */
+    int started;
+    pthread_mutex_t startLock;
+    pthread_cond_t startSignal;
+} sweepJob;
+
+/**
+ * The band of rows [rowStart, rowEnd) owned by one thread, with its own generator.
+ */
+typedef struct bandInfo
+{
+    sweepJob *job;
+    int id;
+    int rowStart;
+    int rowEnd;
+    int cpu;
+    uint64_t seed;
+    long long flips;
+    long long stolenTiles;
+} bandInfo;
+
+/**
+ * Run one colour phase over the tiles: push the tiles of the own band, then work on them and, once they are done,
+ * steal tiles from randomly chosen threads until no tile of the phase is left.
+ */
+void stealingPhase(bandInfo *band, int phase, int color, rng *generator, rng *victims, const pixelKey *key)
+{
+    sweepJob *job = band->job;
+    tileDeque *own = job->deques + band->id;
+    int first = (int)((long long)band->id * job->tileCount / job->threads);
+    int last = (int)((long long)(band->id + 1) * job->tileCount / job->threads);
+    int tile;
+    if (band->id == 0)
+    {
+        // nobody uses the counter of the next phase until everybody passed the barrier at the end of this one
+        atomic_store(job->remaining + (phase + 1) % 2, job->tileCount);
+    }
+    // pushed backwards so that the owner takes them in order, and thieves take the far end of the band
+    for (tile = last - 1; tile >= first; --tile)
+    {
+        pushTile(own, tile);
+    }
+    while (atomic_load(job->remaining + phase % 2) > 0)
+    {
+        tile = takeTile(own);
+        if (tile == NO_TILE)
+        {
+            tile = stealTile(job->deques + nextBounded(victims, job->threads));
+            if (tile < 0)
+            {
+                // let the owners of the last tiles run if the cores are oversubscribed
+                sched_yield();
+                continue;
+            }
+            ++band->stolenTiles;
+        }
+        int rowStart = (tile / job->tileColumns) * job->tileSize;
+        int columnStart = (tile % job->tileColumns) * job->tileSize;
+        int rowEnd = rowStart + job->tileSize < job->rows ? rowStart + job->tileSize : job->rows;
+        int columnEnd = columnStart + job->tileSize < job->columns ? columnStart + job->tileSize : job->columns;
+        band->flips += sweepTile(job->image, job->lattice, job->rows, job->columns, rowStart, rowEnd, columnStart,
+                                 columnEnd, color, job->neighbourhood, generator, key);
+        atomic_fetch_sub(job->remaining + phase % 2, 1);
+    }
+}
+
+void *bandWorker(void *arg)
+{
+    bandInfo *band = (bandInfo *)arg;
+    sweepJob *job = band->job;
+    int colors = (job->neighbourhood->radius + 1) * (job->neighbourhood->radius + 1);
+    int sweep, color, row, phase = 0;
+    rng generator, victims;
+    seedRandom(&generator, band->seed);
+    seedRandom(&victims, ~band->seed);
+    pthread_mutex_lock(&job->startLock);
+    while (job->started == 0)
+    {
+        pthread_cond_wait(&job->startSignal, &job->startLock);
+    }
+    int aborted = job->started < 0;
+    pthread_mutex_unlock(&job->startLock);
+    if (aborted)
+    {
+        return NULL;
+    }
+    if (band->cpu >= 0 && pinThread(band->cpu) != 0)
+    {
+        printf("could not pin thread %d to cpu %d\n", band->id, band->cpu);
+    }
+    /* first touch: the pages of the band are allocated on the NUMA node of the thread that sweeps it */
+    for (row = band->rowStart; row < band->rowEnd; ++row)
+    {
+        memcpy(job->lattice[row], job->image[row], job->columns);
+    }
+    pthread_barrier_wait(&job->barrier);
+    for (sweep = 0; sweep < job->sweeps; ++sweep)
+    {
+        pixelKey key = {job->seed, (uint64_t)sweep, 0, 0};
+        for (color = 0; color < colors; ++color, ++phase)
+        {
+            if (job->tileSize)
+            {
+                stealingPhase(band, phase, color, &generator, &victims, job->keyed ? &key : NULL);
+            }
+            else
+            {
+                band->flips += sweepTile(job->image, job->lattice, job->rows, job->columns, band->rowStart,
+                                         band->rowEnd, 0, job->columns, color, job->neighbourhood, &generator,
+                                         job->keyed ? &key : NULL);
+            }
+            /* the border rows of this band are read by the neighbouring bands in the next phase */
+            pthread_barrier_wait(&job->barrier);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run sweeps over the lattice with one thread per band of rows.
+ * The lattice starts as a copy of the image, made by the thread owning each band.
+ * Within a colour phase the threads only write pixels of that colour, and read pixels of the other colours, which
+ * nobody writes until every thread reached the barrier at the end of the phase: the border rows of a band are never
+ * written while a neighbouring band reads them.
+ * @param image
+ * @param lattice
+ * @param rows
+ * @param columns
+ * @param sweeps
+ * @param threads
+ * @param neighbourhood
+ * @param seed every band gets its own generator seeded from it
+ * @param keyed draw the random numbers from pixelRandom() keyed by the seed instead: the result only depends on the
+ * seed, not on the number of threads nor on the schedule
+ * @param tileSize 0 to statically sweep the own band, or the side of the tiles scheduled by work stealing within
+ * every colour phase: a thread starts with the tiles of its band and steals from the others when it runs out
+ * @param pin whether to pin the thread of each band to a core (see bandCpu())
+ * @return the number of flips, or -1 if the threads could not be started
+ */
+long long bandedSweeps(char **image, char **lattice, int rows, int columns, int sweeps, int threads,
+                       const stencil *neighbourhood, uint64_t seed, int keyed, int tileSize, int pin)
+{
+    sweepJob job = {.image = image, .lattice = lattice, .rows = rows, .columns = columns, .sweeps = sweeps,
+                    .neighbourhood = neighbourhood, .threads = threads, .keyed = keyed, .seed = seed,
+                    .tileSize = tileSize};
+    pthread_t workers[threads];
+    bandInfo bands[threads];
+    tileDeque deques[threads];
+    long long flips = 0, stolenTiles = 0;
+    int cpus[CPU_SETSIZE];
+    int cpuCount = pin ? numaOrderedCpus(cpus, CPU_SETSIZE) : 0;
+    int i, created, allocated = 1;
+
+    if (tileSize)
+    {
+        job.tileColumns = (columns + tileSize - 1) / tileSize;
+        job.tileCount = ((rows + tileSize - 1) / tileSize) * job.tileColumns;
+        job.deques = deques;
+        atomic_init(job.remaining, job.tileCount);
+        atomic_init(job.remaining + 1, job.tileCount);
+        for (i = 0; i < threads; i++)
+        {
+            atomic_init(&deques[i].top, 0);
+            atomic_init(&deques[i].bottom, 0);
+            deques[i].capacity = job.tileCount / threads + 1;
+            deques[i].tiles = (atomic_int *)malloc(deques[i].capacity * sizeof(atomic_int));
+            allocated = allocated && deques[i].tiles;
+        }
+        if (!allocated)
+        {
+            fprintf(stderr, "Not enough memory for the tiles of %d threads\n", threads);
+            for (i = 0; i < threads; i++)
+            {
+                free(deques[i].tiles);
+            }
+            return -1;
+        }
+    }
+    pthread_barrier_init(&job.barrier, NULL, threads);
+    pthread_mutex_init(&job.startLock, NULL);
+    pthread_cond_init(&job.startSignal, NULL);
+    for (i = 0; i < threads; i++)
+    {
+        bands[i].job = &job;
+        bands[i].id = i;
+        bands[i].rowStart = (int)((long long)i * rows / threads);
+        bands[i].rowEnd = (int)((long long)(i + 1) * rows / threads);
+        bands[i].cpu = cpuCount ? bandCpu(i, threads, cpus, cpuCount) : -1;
+        bands[i].seed = seed + i;
+        bands[i].flips = 0;
+        bands[i].stolenTiles = 0;
+        if (pthread_create(&workers[i], NULL, bandWorker, (void *)(bands + i)) != 0)
+        {
+            fprintf(stderr, "Cannot start the thread of band %d\n", i);
+            break;
+        }
+    }
+    created = i;
+    /* the threads wait for all the others to exist: if one is missing, the others would block on the barrier */
+    pthread_mutex_lock(&job.startLock);
+    job.started = created == threads ? 1 : -1;
+    pthread_cond_broadcast(&job.startSignal);
+    pthread_mutex_unlock(&job.startLock);
+    for (i = 0; i < created; i++)
+    {
+        pthread_join(workers[i], NULL);
+        flips += bands[i].flips;
+        stolenTiles += bands[i].stolenTiles;
+    }
+    pthread_cond_destroy(&job.startSignal);
+    pthread_mutex_destroy(&job.startLock);
+    pthread_barrier_destroy(&job.barrier);
+    if (tileSize)
+    {
+        if (created == threads)
+        {
+            printf("work stealing: %d tiles per phase, %lld tiles stolen\n", job.tileCount, stolenTiles);
+        }
+        for (i = 0; i < threads; i++)
+        {
+            free(deques[i].tiles);
+        }
+    }
+    return created == threads ? flips : -1;
+}